@@ -1,449 +1,5940 @@
 /* SPDX-License-Identifier: GPL-2.0 */
 
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/workqueue.h>
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/lockdep.h>
+#include <linux/atomic.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/topology.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/timerqueue.h>
 #include <linux/kfifo.h>
 #include <linux/slab.h>
-#include <linux/delay.h>
+#include <linux/mempool.h>
+#include <linux/overflow.h>
+#include <linux/idr.h>
+#include <linux/xarray.h>
 #include <linux/kobject.h>
 #include <linux/sysfs.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
+#include <linux/vmalloc.h>
+#include <linux/debugfs.h>
 #include <linux/notifier.h>
+#include <linux/kref.h>
+#include <linux/completion.h>
+#include <linux/rculist.h>
+#include <linux/rwsem.h>
+#include <linux/sort.h>
+#include <linux/bsearch.h>
 #include <net/genetlink.h>
 
 #include "lfsm.h"
 
-static const char * const link_state_str[] = {
-    [LINK_DOWN]     = "LINK_DOWN",
-    [LINK_STARTING] = "LINK_STARTING",
-    [LINK_UP]       = "LINK_UP",
-    [LINK_STOPPING] = "LINK_STOPPING",
+#define CREATE_TRACE_POINTS
+#include "lfsm_trace.h"
+
+#define LFSM_QUEUE_LEN 16
+#define LFSM_QUEUE_MAX 4096
+#define LFSM_PRIO_LEN 4 /* priority lane, ahead of the queue */
+
+/*
+ * The published state word packs the current enum link_state into the low
+ * bits and a transition generation counter into the rest, so readers get a
+ * consistent state+generation pair from a single atomic load.
+ */
+#define LFSM_STATE_BITS 8
+#define LFSM_STATE_MASK ((1ULL << LFSM_STATE_BITS) - 1)
+
+static const char * const lfsm_trigger_str[] = {
+    [LFSM_TRIG_UP]      = "LINK_UP",
+    [LFSM_TRIG_DOWN]    = "LINK_DOWN",
+    [LFSM_TRIG_DONE]    = "DONE",
+    [LFSM_TRIG_FAILED]  = "FAILED",
+    [LFSM_TRIG_TIMEOUT] = "TIMEOUT",
+};
+
+/* The table every instance created with lfsm_instance_create() runs */
+static const struct lfsm_state_info lfsm_link_states[LINK_STATE_MAX] = {
+    [LINK_DOWN]     = { "LINK_DOWN",     0 },
+    [LINK_STARTING] = { "LINK_STARTING", LFSM_STATE_TRANSITIONAL },
+    [LINK_UP]       = { "LINK_UP",       LFSM_STATE_LINK_UP },
+    [LINK_STOPPING] = { "LINK_STOPPING", LFSM_STATE_TRANSITIONAL },
+};
+
+static const struct lfsm_transition lfsm_link_trans[LINK_STATE_MAX][LFSM_TRIG_CUSTOM] = {
+    [LINK_DOWN] = {
+        [LFSM_TRIG_UP]      = LFSM_GOTO(LINK_STARTING, LFSM_OP_START_UP),
+    },
+    [LINK_STARTING] = {
+        [LFSM_TRIG_DONE]    = LFSM_GOTO(LINK_UP, LFSM_OP_NONE),
+        [LFSM_TRIG_FAILED]  = LFSM_GOTO(LINK_DOWN, LFSM_OP_NONE),
+        [LFSM_TRIG_TIMEOUT] = LFSM_GOTO(LINK_DOWN, LFSM_OP_NONE),
+    },
+    [LINK_UP] = {
+        [LFSM_TRIG_DOWN]    = LFSM_GOTO(LINK_STOPPING, LFSM_OP_START_DOWN),
+    },
+    [LINK_STOPPING] = {
+        [LFSM_TRIG_DONE]    = LFSM_GOTO(LINK_DOWN, LFSM_OP_NONE),
+        [LFSM_TRIG_FAILED]  = LFSM_GOTO(LINK_DOWN, LFSM_OP_NONE),
+        [LFSM_TRIG_TIMEOUT] = LFSM_GOTO(LINK_DOWN, LFSM_OP_NONE),
+    },
+};
+
+static const struct lfsm_table lfsm_link_table = {
+    .name = "link",
+    .n_states = LINK_STATE_MAX,
+    .n_triggers = LFSM_TRIG_CUSTOM,
+    .initial = LINK_DOWN,
+    .states = lfsm_link_states,
+    .trans = &lfsm_link_trans[0][0],
+};
+
+struct lfsm_action {
+    unsigned int type; /* LFSM_ACT_LINK_UP/DOWN, or a custom enum lfsm_trigger */
+    u64 enqueue_ns;
+    void *context; /* chain of struct lfsm_request, or NULL */
+};
+
+typedef STRUCT_KFIFO_PTR(struct lfsm_action) lfsm_action_fifo;
+
+static const char * const lfsm_cause_str[] = {
+    [LFSM_CAUSE_REQUEST] = "request",
+    [LFSM_CAUSE_FAILURE] = "failure",
+    [LFSM_CAUSE_TIMEOUT] = "timeout",
+    [LFSM_CAUSE_CANCEL]  = "cancel",
+    [LFSM_CAUSE_PREEMPT] = "preempt",
+    [LFSM_CAUSE_RESTORE] = "restore",
+};
+
+static const char * const lfsm_overflow_str[] = {
+    [LFSM_OVERFLOW_REJECT]      = "reject",
+    [LFSM_OVERFLOW_DROP_OLDEST] = "drop-oldest",
+    [LFSM_OVERFLOW_COLLAPSE]    = "collapse",
+};
+
+/*
+ * Slot of the per-instance history ring. Written under the instance lock,
+ * read locklessly: @seq is odd while the slot is being rewritten, and @pos
+ * tells a reader which event the slot currently holds.
+ */
+struct lfsm_history_slot {
+    u32 seq;
+    u64 pos;
+    struct lfsm_history_record rec;
+};
+
+/*
+ * One state machine per logical link. Each instance owns its state, action
+ * queue, lock and work items, so a slow transition on one link never holds
+ * up another. Instances are reference counted through the embedded kobject,
+ * which also backs /sys/kernel/lfsm/<name>/.
+ *
+ * Locking: @lock is a spinlock taken with interrupts off, because
+ * lfsm_transition_complete() may run in hard IRQ. It covers the state word
+ * updates, the queue, the dispatcher flag and the configuration fields.
+ * Nothing sleeps, waits for work or calls out to drivers or subscribers
+ * under it; those run after it is dropped. A task holds at most one
+ * instance lock at a time, and only workqueue and completion internals
+ * and the timeout base locks nest inside it.
+ */
+struct lfsm_instance {
+    struct kobject kobj;
+    struct list_head node;
+    char name[LFSM_NAME_LEN];
+    u32 id;
+
+    spinlock_t lock;
+    atomic64_t state_gen; /* written under lock, read locklessly */
+    lfsm_action_fifo queue;
+    DECLARE_KFIFO(prio, struct lfsm_action, LFSM_PRIO_LEN); /* urgent actions */
+    bool work_active;
+    bool dead;             /* lfsm_instance_destroy() has begun, refuse requests */
+    bool direct_dispatch;  /* start idle transitions in the caller's context */
+    bool dispatch_inline;  /* caller of enqueue_lfsm_action() will dispatch */
+    bool coalesce;
+    u64 elided; /* requests dropped by coalescing */
+    enum lfsm_overflow_policy overflow_policy;
+    unsigned int queue_hwm; /* deepest the queue has been */
+    u64 overflows; /* requests that found the queue full */
+    u64 lock_contended; /* acquisitions of @lock that had to wait */
+    struct kernfs_node *state_kn; /* sysfs "state", poked on every change */
+
+    const struct lfsm_table *table;
+    const struct lfsm_ops *ops;
+    void *priv;
+    struct lfsm_event notify_event; /* handed to complete_work */
+    u64 event_seq;
+    struct lfsm_history_slot history[LFSM_HISTORY_LEN];
+    u64 history_head; /* transitions recorded, published with release */
+    struct list_head waiters; /* requests settled by the transition in flight */
+    unsigned int request_reserve; /* handles this instance added to the pool */
+
+    /* Dependency graph, see lfsm_instance_add_dependency() */
+    struct list_head dep_parents;  /* struct lfsm_dep.parent_entry, RCU */
+    struct list_head dep_children; /* struct lfsm_dep.child_entry, RCU */
+    bool dep_blocked;              /* the queue's head waits for a dependency */
+    u64 dep_epoch;                 /* last lfsm_dep_reaches() walk, under lfsm_deps_lock */
+    unsigned int dep_height;       /* ancestor levels seen by that walk */
+    u64 dep_waits;                 /* dispatches that had to wait */
+
+    unsigned int delay_ms;
+    unsigned int timeout_ms;
+
+    /* Debounce and flap hold-down of UP/DOWN requests, see lfsm_hold_action() */
+    unsigned int debounce_ms;
+    unsigned int holddown_flaps;   /* flaps that start a hold-down, 0 = off */
+    unsigned int holddown_ms;      /* first hold-down, doubled by each repeat */
+    unsigned int holddown_max_ms;  /* cap, and the quiet time that forgives */
+    unsigned int holddown_cur_ms;  /* length of the next hold-down */
+    unsigned int flaps;
+    unsigned int last_req_type;    /* LFSM_ACT_MAX before the first request */
+    ktime_t last_flap;
+    ktime_t holddown_until;
+    unsigned int held_type;        /* LFSM_ACT_MAX when nothing is held */
+    struct lfsm_request *held_req;
+    ktime_t held_until;
+    struct hrtimer hold_timer;
+    u64 debounced;  /* held requests replaced by a newer one */
+    u64 holddowns;  /* hold-downs started */
+
+    bool timeout_fixed;        /* the transition in flight has its own timeout */
+    bool highpri;
+    int numa_node;             /* NUMA_NO_NODE for no preference */
+    bool cpumask_set;          /* cpumask restricts where work runs */
+    cpumask_var_t cpumask;     /* written under lock */
+    unsigned long transition_start; /* jiffies */
+    ktime_t timeout_expires;        /* what the armed timeout is for */
+    unsigned long delay_expires;    /* jiffies the armed delay is for */
+    u64 delay_gen;                  /* transition the armed delay ends */
+    u64 op_gen;                     /* last transition its driver op was called for */
+    u64 abort_gen;                  /* ended transition owed an abort op, 0 for none */
+    u64 dispatch_ns;
+
+    struct work_struct worker;
+    struct work_struct complete_work;
+    struct work_struct dep_work;
+    struct delayed_work delay_work;
+    struct timerqueue_node timeout_node; /* on a timeout base while armed */
+    int timeout_cpu;                     /* base armed on, -1 for none */
+};
+
+static inline enum link_state lfsm_read_state(struct lfsm_instance *inst)
+{
+    return atomic64_read(&inst->state_gen) & LFSM_STATE_MASK;
+}
+
+static inline u64 lfsm_read_gen(struct lfsm_instance *inst)
+{
+    return atomic64_read(&inst->state_gen) >> LFSM_STATE_BITS;
+}
+
+// --- Shared State Page ---
+
+/*
+ * Every instance's state is mirrored into a vmalloc'ed page set that
+ * /dev/lfsm_state maps read-only, so user space can poll link states with
+ * plain loads. Slots are written under their instance's lock, which makes
+ * inst->lock the writer side of the seqcount-style protocol in lfsm_uapi.h.
+ */
+#define LFSM_SHM_SIZE PAGE_ALIGN(sizeof(struct lfsm_shm_header) + \
+                                 LFSM_SHM_SLOTS * sizeof(struct lfsm_state_slot))
+
+static void *lfsm_shm;
+
+static struct lfsm_state_slot *lfsm_shm_slot(const struct lfsm_instance *inst)
+{
+    struct lfsm_state_slot *slots = lfsm_shm + sizeof(struct lfsm_shm_header);
+
+    return inst->id < LFSM_SHM_SLOTS ? &slots[inst->id] : NULL;
+}
+
+static inline void lfsm_shm_write_begin(struct lfsm_state_slot *slot)
+{
+    WRITE_ONCE(slot->seq, slot->seq + 1);
+    smp_wmb();
+}
+
+static inline void lfsm_shm_write_end(struct lfsm_state_slot *slot)
+{
+    smp_wmb();
+    WRITE_ONCE(slot->seq, slot->seq + 1);
+}
+
+/* Caller holds inst->lock. Publishes the state word @v. */
+static void lfsm_shm_update(struct lfsm_instance *inst, u64 v)
+{
+    struct lfsm_state_slot *slot = lfsm_shm_slot(inst);
+
+    if (!slot)
+        return;
+
+    lfsm_shm_write_begin(slot);
+    WRITE_ONCE(slot->state, v & LFSM_STATE_MASK);
+    WRITE_ONCE(slot->gen, v >> LFSM_STATE_BITS);
+    WRITE_ONCE(slot->timestamp_ns, ktime_get_ns());
+    lfsm_shm_write_end(slot);
+}
+
+/* Caller holds inst->lock. Fills in, or with @live false clears, @inst's slot. */
+static void lfsm_shm_publish(struct lfsm_instance *inst, bool live)
+{
+    struct lfsm_state_slot *slot = lfsm_shm_slot(inst);
+    u64 v = atomic64_read(&inst->state_gen);
+
+    lockdep_assert_held(&inst->lock);
+    if (!slot)
+        return;
+
+    lfsm_shm_write_begin(slot);
+    WRITE_ONCE(slot->flags, live ? LFSM_SLOT_VALID : 0);
+    WRITE_ONCE(slot->id, inst->id);
+    WRITE_ONCE(slot->state, v & LFSM_STATE_MASK);
+    WRITE_ONCE(slot->gen, v >> LFSM_STATE_BITS);
+    WRITE_ONCE(slot->timestamp_ns, ktime_get_ns());
+    if (live)
+        memcpy(slot->name, inst->name, sizeof(slot->name));
+    else
+        memset(slot->name, 0, sizeof(slot->name));
+    lfsm_shm_write_end(slot);
+}
+
+/* Caller holds inst->lock; bumps the generation on every actual change */
+static void lfsm_set_state(struct lfsm_instance *inst, enum link_state state)
+{
+    u64 v = atomic64_read(&inst->state_gen);
+    u64 gen = (v >> LFSM_STATE_BITS) + 1;
+    unsigned int old = v & LFSM_STATE_MASK;
+
+    lockdep_assert_held(&inst->lock);
+    if (old == state)
+        return;
+
+    atomic64_set(&inst->state_gen, (gen << LFSM_STATE_BITS) | state);
+    lfsm_shm_update(inst, (gen << LFSM_STATE_BITS) | state);
+    trace_lfsm_state_change(inst->id, inst->name, old,
+                            lfsm_instance_state_name(inst, old),
+                            state, lfsm_instance_state_name(inst, state), gen);
+}
+
+/*
+ * Caller holds inst->lock, about to end the transition in flight other than
+ * through its driver's report. If the driver op was called for it, the
+ * abort op is owed and runs from lfsm_call_abort().
+ */
+static void lfsm_note_abort(struct lfsm_instance *inst)
+{
+    u64 gen = lfsm_read_gen(inst);
+
+    lockdep_assert_held(&inst->lock);
+    if (inst->op_gen == gen)
+        inst->abort_gen = gen;
+}
+
+/* Caller holds inst->lock. Takes the abort op owed, if any. */
+static u64 lfsm_take_abort(struct lfsm_instance *inst)
+{
+    u64 gen = inst->abort_gen;
+
+    lockdep_assert_held(&inst->lock);
+    inst->abort_gen = 0;
+    return gen;
+}
+
+/* Process context, no instance locks held */
+static void lfsm_call_abort(struct lfsm_instance *inst, u64 gen)
+{
+    if (gen && inst->ops->abort)
+        inst->ops->abort(inst, inst->priv, gen);
+}
+
+// --- Transition Tables ---
+
+/* The one lookup every trigger costs; @trigger is below n_triggers */
+static inline const struct lfsm_transition *
+lfsm_lookup(const struct lfsm_instance *inst, unsigned int state, unsigned int trigger)
+{
+    return &inst->table->trans[state * inst->table->n_triggers + trigger];
+}
+
+static inline bool lfsm_state_transitional(const struct lfsm_instance *inst,
+                                           unsigned int state)
+{
+    return inst->table->states[state].flags & LFSM_STATE_TRANSITIONAL;
+}
+
+/*
+ * Maps @state onto the two-state view of link_up/link_down callers:
+ * LINK_UP or LINK_DOWN for a stable state, LINK_STATE_MAX while in transition.
+ */
+static enum link_state lfsm_state_link(const struct lfsm_instance *inst, unsigned int state)
+{
+    unsigned int flags = inst->table->states[state].flags;
+
+    if (flags & LFSM_STATE_TRANSITIONAL)
+        return LINK_STATE_MAX;
+    return (flags & LFSM_STATE_LINK_UP) ? LINK_UP : LINK_DOWN;
+}
+
+static enum link_state lfsm_action_target(enum lfsm_action_type type)
+{
+    return (type == LFSM_ACT_LINK_UP) ? LINK_UP : LINK_DOWN;
+}
+
+static const char *lfsm_trigger_name(const struct lfsm_instance *inst, unsigned int trigger)
+{
+    if (trigger < LFSM_TRIG_CUSTOM)
+        return lfsm_trigger_str[trigger];
+    if (inst->table->trigger_names && inst->table->trigger_names[trigger - LFSM_TRIG_CUSTOM])
+        return inst->table->trigger_names[trigger - LFSM_TRIG_CUSTOM];
+    return "CUSTOM";
+}
+
+/**
+ * lfsm_instance_state_name - Name of a state of an instance's table.
+ * @inst: The LFSM instance.
+ * @state: State, as returned by lfsm_instance_get_link_state().
+ *
+ * Return: The name from the instance's table, or "UNKNOWN".
+ */
+const char *lfsm_instance_state_name(const struct lfsm_instance *inst, unsigned int state)
+{
+    return state < inst->table->n_states ? inst->table->states[state].name : "UNKNOWN";
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_state_name);
+
+/**
+ * lfsm_table_validate - Checks a transition table.
+ * @table: The table to check.
+ *
+ * Every cell has to name an existing state and an op that fits it: driver
+ * ops only lead into transitional states, and a transitional state is left,
+ * towards a stable state, by exactly its DONE, FAILED and TIMEOUT cells.
+ * The first problem found is logged.
+ *
+ * Return: 0 if @table can run an instance, -EINVAL otherwise.
+ */
+int lfsm_table_validate(const struct lfsm_table *table)
+{
+    const char *name = (table && table->name) ? table->name : "?";
+    unsigned int s, t, ns, nt;
+
+    if (!table || !table->states || !table->trans ||
+        !table->n_states || table->n_states > LFSM_TABLE_MAX_STATES ||
+        table->n_triggers < LFSM_TRIG_CUSTOM ||
+        table->n_triggers > LFSM_TABLE_MAX_TRIGGERS) {
+        pr_err("LFSM: table %s: bad dimensions\n", name);
+        return -EINVAL;
+    }
+    ns = table->n_states;
+    nt = table->n_triggers;
+
+    if (table->initial >= ns ||
+        (table->states[table->initial].flags & LFSM_STATE_TRANSITIONAL)) {
+        pr_err("LFSM: table %s: initial state must be stable\n", name);
+        return -EINVAL;
+    }
+
+    for (s = 0; s < ns; s++) {
+        bool transitional = table->states[s].flags & LFSM_STATE_TRANSITIONAL;
+
+        if (!table->states[s].name) {
+            pr_err("LFSM: table %s: state %u has no name\n", name, s);
+            return -EINVAL;
+        }
+
+        for (t = 0; t < nt; t++) {
+            const struct lfsm_transition *e = &table->trans[s * nt + t];
+            bool ending = t == LFSM_TRIG_DONE || t == LFSM_TRIG_FAILED ||
+                          t == LFSM_TRIG_TIMEOUT;
+
+            if (e->op == LFSM_OP_INVALID) {
+                if (transitional && ending)
+                    goto bad;
+                continue;
+            }
+            if (e->op >= LFSM_OP_MAX || e->next >= ns || transitional != ending)
+                goto bad;
+            /* Driver ops start transitions; transitions settle without one */
+            if ((table->states[e->next].flags & LFSM_STATE_TRANSITIONAL) ?
+                transitional : e->op != LFSM_OP_NONE)
+                goto bad;
+        }
+    }
+    return 0;
+
+bad:
+    pr_err("LFSM: table %s: invalid transition from %s on trigger %u\n",
+           name, table->states[s].name, t);
+    return -EINVAL;
+}
+EXPORT_SYMBOL_GPL(lfsm_table_validate);
+
+// --- Request Handles ---
+
+/*
+ * A request handle follows one link_up/link_down call to its outcome. While
+ * queued it rides in lfsm_action.context, chained through @next when
+ * coalescing folds several calls into one action. Once its action is
+ * dispatched, or the call is folded into the transition in flight, it moves
+ * to the instance's waiters and is finished when the instance settles. The
+ * caller and the FSM each hold a reference.
+ *
+ * Handles come from their own slab cache through a mempool that every
+ * instance tops up by request_reserve elements while it exists, so
+ * requests made in atomic context keep working when GFP_NOWAIT does not.
+ */
+struct lfsm_request {
+    struct kref ref;
+    struct completion done;
+    enum link_state target;
+    int status;
+    struct lfsm_request *next;
+    struct list_head node;
+};
+
+/* Elements the pool keeps with no instance around */
+#define LFSM_REQUEST_POOL_MIN 8
+
+static struct kmem_cache *lfsm_request_cache;
+static mempool_t *lfsm_request_pool;
+static int lfsm_request_pool_size = LFSM_REQUEST_POOL_MIN; /* under lfsm_instances_lock */
+
+static void lfsm_request_release(struct kref *ref)
+{
+    mempool_free(container_of(ref, struct lfsm_request, ref), lfsm_request_pool);
+}
+
+/* Any context. Finishes every request on @chain and drops the FSM's references. */
+static void lfsm_request_finish(struct lfsm_request *chain, int status)
+{
+    struct lfsm_request *next;
+
+    for (; chain; chain = next) {
+        next = chain->next;
+        chain->next = NULL;
+        WRITE_ONCE(chain->status, status);
+        complete_all(&chain->done);
+        kref_put(&chain->ref, lfsm_request_release);
+    }
+}
+
+/* Caller holds inst->lock. Hands @chain to the transition in flight. */
+static void lfsm_request_wait_settle(struct lfsm_instance *inst, struct lfsm_request *chain)
+{
+    struct lfsm_request *next;
+
+    lockdep_assert_held(&inst->lock);
+    for (; chain; chain = next) {
+        next = chain->next;
+        chain->next = NULL;
+        list_add_tail(&chain->node, &inst->waiters);
+    }
+}
+
+/*
+ * Caller holds inst->lock. Resolves a chain whose call needed no action of
+ * its own: at once if the link is already there, otherwise when the
+ * transition in flight, which is heading the same way, ends.
+ */
+static void lfsm_request_elide(struct lfsm_instance *inst, struct lfsm_request *chain)
+{
+    if (!chain)
+        return;
+    if (lfsm_state_link(inst, lfsm_read_state(inst)) == chain->target)
+        lfsm_request_finish(chain, 0);
+    else
+        lfsm_request_wait_settle(inst, chain);
+}
+
+/*
+ * Caller holds inst->lock. The instance has just settled in @state. @err is
+ * 0 for a completed transition, in which case waiters that wanted the other
+ * state were superseded; otherwise it is the outcome for every waiter.
+ */
+static void lfsm_settle_requests(struct lfsm_instance *inst, enum link_state state, int err)
+{
+    enum link_state link = lfsm_state_link(inst, state);
+    struct lfsm_request *req, *tmp;
+
+    lockdep_assert_held(&inst->lock);
+    list_for_each_entry_safe(req, tmp, &inst->waiters, node) {
+        list_del(&req->node);
+        lfsm_request_finish(req, err ? err : (req->target == link ? 0 : -ECANCELED));
+    }
+}
+
+/* Caller holds inst->lock. Empties the queue, cancelling the requests on it. */
+static void lfsm_flush_queue(struct lfsm_instance *inst)
+{
+    struct lfsm_action act;
+
+    lockdep_assert_held(&inst->lock);
+    while (kfifo_get(&inst->queue, &act))
+        lfsm_request_finish(act.context, -ECANCELED);
+}
+
+/* Caller holds inst->lock. Empties the priority lane. */
+static void lfsm_flush_urgent(struct lfsm_instance *inst)
+{
+    lockdep_assert_held(&inst->lock);
+    kfifo_reset(&inst->prio);
+}
+
+/*
+ * Instance work goes to one of four shared workqueues. By default it runs
+ * unbound at normal priority. An instance can ask for WQ_HIGHPRI workers,
+ * and can keep its transitions near its device with either a CPU mask,
+ * which selects the bound queues, or a NUMA node, which keeps unbound work
+ * on that node's worker pool.
+ */
+enum lfsm_wq_type {
+    LFSM_WQ_UNBOUND,
+    LFSM_WQ_UNBOUND_HIGHPRI,
+    LFSM_WQ_BOUND,
+    LFSM_WQ_BOUND_HIGHPRI,
+    LFSM_WQ_MAX
+};
+
+static const struct {
+    const char *name;
+    unsigned int flags;
+} lfsm_wq_defs[LFSM_WQ_MAX] = {
+    [LFSM_WQ_UNBOUND]         = { "lfsm_wq",               WQ_UNBOUND },
+    [LFSM_WQ_UNBOUND_HIGHPRI] = { "lfsm_highpri_wq",       WQ_UNBOUND | WQ_HIGHPRI },
+    [LFSM_WQ_BOUND]           = { "lfsm_bound_wq",         0 },
+    [LFSM_WQ_BOUND_HIGHPRI]   = { "lfsm_bound_highpri_wq", WQ_HIGHPRI },
+};
+
+static struct workqueue_struct *lfsm_wqs[LFSM_WQ_MAX];
+static struct workqueue_struct *lfsm_notify_wq; /* parallel subscriber calls */
+
+/*
+ * Picks the workqueue and CPU for @inst's next work item. May be called
+ * without inst->lock; a placement change racing with it only decides which
+ * of the old or new places this one item runs.
+ */
+static struct workqueue_struct *lfsm_inst_wq(struct lfsm_instance *inst, int *cpu)
+{
+    bool highpri = READ_ONCE(inst->highpri);
+    int node = READ_ONCE(inst->numa_node);
+    unsigned int c;
+
+    *cpu = WORK_CPU_UNBOUND;
+    if (READ_ONCE(inst->cpumask_set)) {
+        c = cpumask_any_and(inst->cpumask, cpu_online_mask);
+        if (c < nr_cpu_ids) {
+            *cpu = c;
+            return lfsm_wqs[highpri ? LFSM_WQ_BOUND_HIGHPRI : LFSM_WQ_BOUND];
+        }
+        /* Every CPU in the mask is offline: run anywhere */
+    } else if (node != NUMA_NO_NODE) {
+        /* On an unbound queue the CPU only selects the node's pool */
+        c = cpumask_any_and(cpumask_of_node(node), cpu_online_mask);
+        if (c < nr_cpu_ids)
+            *cpu = c;
+    }
+    return lfsm_wqs[highpri ? LFSM_WQ_UNBOUND_HIGHPRI : LFSM_WQ_UNBOUND];
+}
+
+static bool lfsm_queue_work(struct lfsm_instance *inst, struct work_struct *work)
+{
+    struct workqueue_struct *wq;
+    int cpu;
+
+    wq = lfsm_inst_wq(inst, &cpu);
+    return queue_work_on(cpu, wq, work);
+}
+
+static bool lfsm_queue_delayed_work(struct lfsm_instance *inst, struct delayed_work *dwork,
+                                    unsigned long delay)
+{
+    struct workqueue_struct *wq;
+    int cpu;
+
+    wq = lfsm_inst_wq(inst, &cpu);
+    return queue_delayed_work_on(cpu, wq, dwork, delay);
+}
+
+static bool lfsm_mod_delayed_work(struct lfsm_instance *inst, struct delayed_work *dwork,
+                                  unsigned long delay)
+{
+    struct workqueue_struct *wq;
+    int cpu;
+
+    wq = lfsm_inst_wq(inst, &cpu);
+    return mod_delayed_work_on(cpu, wq, dwork, delay);
+}
+static struct kobject *lfsm_kobj;
+
+/* Defaults for new instances; each instance can be retuned at runtime */
+static unsigned int lfsm_delay_ms = LFSM_DELAY_MS;
+module_param_named(delay_ms, lfsm_delay_ms, uint, 0644);
+MODULE_PARM_DESC(delay_ms, "Default transition delay for instances without driver ops (ms)");
+
+static unsigned int lfsm_timeout_ms = LFSM_TIMEOUT_MS;
+module_param_named(timeout_ms, lfsm_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(timeout_ms, "Default transition timeout (ms)");
+
+static bool lfsm_coalesce = false;
+module_param_named(coalesce, lfsm_coalesce, bool, 0644);
+MODULE_PARM_DESC(coalesce, "Coalesce redundant actions on new instances");
+
+static bool lfsm_direct_dispatch = false;
+module_param_named(direct_dispatch, lfsm_direct_dispatch, bool, 0644);
+MODULE_PARM_DESC(direct_dispatch, "Start transitions of idle new instances from sleepable callers directly");
+
+static unsigned int lfsm_queue_depth = LFSM_QUEUE_LEN;
+module_param_named(queue_depth, lfsm_queue_depth, uint, 0644);
+MODULE_PARM_DESC(queue_depth, "Action queue depth of new instances, rounded up to a power of two");
+
+static unsigned int lfsm_overflow_policy = LFSM_OVERFLOW_REJECT;
+module_param_named(overflow_policy, lfsm_overflow_policy, uint, 0644);
+MODULE_PARM_DESC(overflow_policy, "Full queue policy of new instances (0=reject, 1=drop-oldest, 2=collapse)");
+
+static bool lfsm_notify_parallel = false;
+module_param_named(notify_parallel, lfsm_notify_parallel, bool, 0644);
+MODULE_PARM_DESC(notify_parallel, "Call blocking subscribers concurrently, one work item each");
+
+static bool lfsm_notify_wait = true;
+module_param_named(notify_wait, lfsm_notify_wait, bool, 0644);
+MODULE_PARM_DESC(notify_wait, "With notify_parallel, hold the next action until all subscribers return");
+
+static unsigned int lfsm_request_reserve = 8;
+module_param_named(request_reserve, lfsm_request_reserve, uint, 0644);
+MODULE_PARM_DESC(request_reserve, "Request handles preallocated for each new instance");
+
+static unsigned int lfsm_event_ring = 1024;
+module_param_named(event_ring, lfsm_event_ring, uint, 0644);
+MODULE_PARM_DESC(event_ring, "Records buffered per /dev/lfsm_events reader, rounded up to a power of two");
+
+// --- Statistics ---
+
+enum lfsm_stat {
+    LFSM_STAT_ENQUEUED,
+    LFSM_STAT_REJECTED_BUSY,
+    LFSM_STAT_REJECTED_NOSPC,
+    LFSM_STAT_COMPLETED,
+    LFSM_STAT_TIMEOUTS,
+    LFSM_STAT_FORCE_DOWNS,
+    LFSM_STAT_NOTIFY_RESERVE,
+    LFSM_STAT_NOTIFY_DROPPED,
+    LFSM_STAT_DIRECT_DISPATCHES,
+    LFSM_STAT_LOCK_CONTENDED,
+    LFSM_STAT_PREEMPTED,
+    LFSM_STAT_MAX
+};
+
+static const char * const lfsm_stat_str[] = {
+    [LFSM_STAT_ENQUEUED]       = "enqueued",
+    [LFSM_STAT_REJECTED_BUSY]  = "rejected_busy",
+    [LFSM_STAT_REJECTED_NOSPC] = "rejected_nospc",
+    [LFSM_STAT_COMPLETED]      = "completed",
+    [LFSM_STAT_TIMEOUTS]       = "timeouts",
+    [LFSM_STAT_FORCE_DOWNS]    = "force_downs",
+    [LFSM_STAT_NOTIFY_RESERVE] = "notify_reserve",
+    [LFSM_STAT_NOTIFY_DROPPED] = "notify_dropped",
+    [LFSM_STAT_DIRECT_DISPATCHES] = "direct_dispatches",
+    [LFSM_STAT_LOCK_CONTENDED] = "lock_contended",
+    [LFSM_STAT_PREEMPTED] = "preempted",
+};
+
+enum lfsm_hist {
+    LFSM_HIST_ENQUEUE_TO_DISPATCH,
+    LFSM_HIST_DISPATCH_TO_COMPLETE,
+    LFSM_HIST_NOTIFY,
+    LFSM_HIST_MAX
+};
+
+static const char * const lfsm_hist_str[] = {
+    [LFSM_HIST_ENQUEUE_TO_DISPATCH]  = "enqueue_to_dispatch_ns",
+    [LFSM_HIST_DISPATCH_TO_COMPLETE] = "dispatch_to_complete_ns",
+    [LFSM_HIST_NOTIFY]               = "notify_ns",
+};
+
+/*
+ * log2 latency buckets: bucket 0 counts 0 ns, bucket b counts
+ * [2^(b-1), 2^b) ns, and the last bucket also takes everything above.
+ */
+#define LFSM_HIST_BUCKETS 40
+
+/*
+ * Hot paths only ever touch their own CPU's copy; readers sum all CPUs.
+ * Counts may be momentarily inconsistent with each other, never lost.
+ */
+struct lfsm_stats {
+    u64 count[LFSM_STAT_MAX];
+    u64 hist[LFSM_HIST_MAX][LFSM_HIST_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct lfsm_stats, lfsm_stats);
+
+static inline void lfsm_stat_inc(enum lfsm_stat stat)
+{
+    this_cpu_inc(lfsm_stats.count[stat]);
+}
+
+static inline void lfsm_hist_add(enum lfsm_hist hist, u64 ns)
+{
+    this_cpu_inc(lfsm_stats.hist[hist][min_t(unsigned int, fls64(ns), LFSM_HIST_BUCKETS - 1)]);
+}
+
+/*
+ * Every acquisition of inst->lock goes through one of these, counting the
+ * ones that found it held, so lock_contended covers dispatch, timeouts,
+ * force_down and configuration as well as requests and completions.
+ */
+#define lfsm_lock_irqsave(inst, flags)                          \
+    do {                                                        \
+        if (!spin_trylock_irqsave(&(inst)->lock, flags)) {      \
+            spin_lock_irqsave(&(inst)->lock, flags);            \
+            (inst)->lock_contended++;                           \
+            lfsm_stat_inc(LFSM_STAT_LOCK_CONTENDED);            \
+        }                                                       \
+    } while (0)
+
+#define lfsm_lock_irq(inst)                                     \
+    do {                                                        \
+        if (!spin_trylock_irq(&(inst)->lock)) {                 \
+            spin_lock_irq(&(inst)->lock);                       \
+            (inst)->lock_contended++;                           \
+            lfsm_stat_inc(LFSM_STAT_LOCK_CONTENDED);            \
+        }                                                       \
+    } while (0)
+
+static void lfsm_stats_sum(struct lfsm_stats *sum)
+{
+    int cpu, i, b;
+
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu) {
+        const struct lfsm_stats *st = per_cpu_ptr(&lfsm_stats, cpu);
+
+        for (i = 0; i < LFSM_STAT_MAX; i++)
+            sum->count[i] += READ_ONCE(st->count[i]);
+        for (i = 0; i < LFSM_HIST_MAX; i++)
+            for (b = 0; b < LFSM_HIST_BUCKETS; b++)
+                sum->hist[i][b] += READ_ONCE(st->hist[i][b]);
+    }
+}
+
+/* All live instances, protected by lfsm_instances_lock */
+static LIST_HEAD(lfsm_instances);
+static DEFINE_MUTEX(lfsm_instances_lock);
+static DEFINE_IDA(lfsm_ida);
+/* id -> live instance, written under lfsm_instances_lock */
+static DEFINE_XARRAY(lfsm_instances_xa);
+
+/* Backs the legacy single-link API and the top-level sysfs files */
+static struct lfsm_instance *lfsm_default;
+
+// --- Dependencies ---
+
+/*
+ * A child instance depends on its parents: its LINK_UP actions wait at the
+ * head of its queue until every parent is UP, and a parent's LINK_DOWN
+ * waits until every child is DOWN, taking the children down first. Each
+ * instance keeps dispatching on its own worker, so independent subtrees
+ * come up in parallel and a whole topology takes as many steps as it is
+ * deep. Every settled state change kicks the instance's waiting parents
+ * and children. Edges change under lfsm_deps_lock; the dispatcher walks
+ * them under RCU.
+ */
+struct lfsm_dep {
+    struct lfsm_instance *parent;
+    struct lfsm_instance *child;
+    struct list_head parent_entry; /* on child->dep_parents */
+    struct list_head child_entry;  /* on parent->dep_children */
+    struct rcu_head rcu;
+};
+
+static DEFINE_MUTEX(lfsm_deps_lock);
+
+static bool lfsm_dep_is(struct lfsm_instance *inst, enum link_state link)
+{
+    return lfsm_state_link(inst, lfsm_read_state(inst)) == link;
+}
+
+/*
+ * Caller holds inst->lock. Returns true if the UP/DOWN @type must wait for
+ * a dependency, noting that the dispatcher stopped for it. A waiting DOWN
+ * has dep_work ask the children to go down.
+ */
+static bool lfsm_dep_wait(struct lfsm_instance *inst, unsigned int type)
+{
+    struct lfsm_dep *dep;
+    bool wait = false;
+
+    lockdep_assert_held(&inst->lock);
+    rcu_read_lock();
+    if (type == LFSM_ACT_LINK_UP) {
+        list_for_each_entry_rcu(dep, &inst->dep_parents, parent_entry) {
+            if (!lfsm_dep_is(dep->parent, LINK_UP)) {
+                wait = true;
+                break;
+            }
+        }
+    } else if (type == LFSM_ACT_LINK_DOWN) {
+        list_for_each_entry_rcu(dep, &inst->dep_children, child_entry) {
+            if (!lfsm_dep_is(dep->child, LINK_DOWN)) {
+                wait = true;
+                break;
+            }
+        }
+    }
+    rcu_read_unlock();
+
+    if (!wait)
+        return false;
+    if (!inst->dep_blocked) {
+        inst->dep_blocked = true;
+        inst->dep_waits++;
+    }
+    if (type == LFSM_ACT_LINK_DOWN)
+        lfsm_queue_work(inst, &inst->dep_work);
+    return true;
+}
+
+/* Restarts @inst's dispatcher if it stopped for a dependency. */
+static void lfsm_dep_kick(struct lfsm_instance *inst)
+{
+    unsigned long flags;
+
+    lfsm_lock_irqsave(inst, flags);
+    if (inst->dep_blocked && !inst->work_active && !inst->dead) {
+        inst->dep_blocked = false;
+        inst->work_active = true;
+        lfsm_queue_work(inst, &inst->worker);
+    }
+    spin_unlock_irqrestore(&inst->lock, flags);
+}
+
+/*
+ * Any context, no instance locks held. @inst settled in a new state: its
+ * waiting parents and children re-check their dependencies, and a link
+ * that ended up DOWN takes its children down with it. A child that was
+ * busy when its parent fell and has since come UP asks that parent to
+ * take it down now.
+ */
+static void lfsm_dep_settled(struct lfsm_instance *inst)
+{
+    bool up = lfsm_dep_is(inst, LINK_UP);
+    struct lfsm_dep *dep;
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(dep, &inst->dep_parents, parent_entry) {
+        lfsm_dep_kick(dep->parent);
+        if (up && lfsm_dep_is(dep->parent, LINK_DOWN))
+            lfsm_queue_work(dep->parent, &dep->parent->dep_work);
+    }
+    list_for_each_entry_rcu(dep, &inst->dep_children, child_entry)
+        lfsm_dep_kick(dep->child);
+    if (!list_empty(&inst->dep_children) && lfsm_dep_is(inst, LINK_DOWN))
+        lfsm_queue_work(inst, &inst->dep_work);
+    rcu_read_unlock();
+}
+
+// --- Event Device ---
+
+/*
+ * Every open file of /dev/lfsm_events has its own ring of transition
+ * records, filled straight from the context that changed the state, so a
+ * single fd follows every instance. A full ring drops its oldest record and
+ * the next read() starts with an LFSM_EVREC_OVERRUN record counting the
+ * loss. Readers are walked under RCU; each ring has its own lock.
+ */
+#define LFSM_EVENT_RING_MAX 65536
+#define LFSM_EVENT_BATCH 64 /* records copied out per lock hold */
+
+typedef STRUCT_KFIFO_PTR(struct lfsm_event_record) lfsm_record_fifo;
+
+struct lfsm_evdev_reader {
+    struct list_head node;
+    spinlock_t lock;        /* covers @ring and @lost, taken with IRQs off */
+    lfsm_record_fifo ring;
+    u64 lost;               /* records dropped since the last read() */
+    wait_queue_head_t wait;
+    struct mutex read_lock; /* serialises read() and owns @batch */
+    struct rcu_head rcu;
+    struct lfsm_event_record batch[LFSM_EVENT_BATCH];
+};
+
+static LIST_HEAD(lfsm_evdev_readers);
+static DEFINE_SPINLOCK(lfsm_evdev_readers_lock);
+static struct kernfs_node *lfsm_state_kn; /* /sys/kernel/lfsm/state */
+
+/* Any context, no instance locks held */
+static void lfsm_evdev_post(const struct lfsm_event *ev)
+{
+    struct lfsm_event_record rec = {
+        .seq = ev->seq,
+        .timestamp_ns = ev->timestamp_ns,
+        .id = ev->inst->id,
+        .old_state = ev->old_state,
+        .new_state = ev->new_state,
+        .cause = ev->cause,
+    };
+    struct lfsm_evdev_reader *r;
+    unsigned long flags;
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(r, &lfsm_evdev_readers, node) {
+        spin_lock_irqsave(&r->lock, flags);
+        if (kfifo_is_full(&r->ring)) {
+            kfifo_skip(&r->ring);
+            r->lost++;
+        }
+        kfifo_put(&r->ring, rec);
+        spin_unlock_irqrestore(&r->lock, flags);
+        wake_up_interruptible(&r->wait);
+    }
+    rcu_read_unlock();
+}
+
+/* Any context, no instance locks held. Wakes poll() on the state files. */
+static void lfsm_state_notify(struct lfsm_instance *inst)
+{
+    if (inst->state_kn)
+        sysfs_notify_dirent(inst->state_kn);
+    if (inst == READ_ONCE(lfsm_default) && lfsm_state_kn)
+        sysfs_notify_dirent(lfsm_state_kn);
+}
+
+static int lfsm_evdev_open(struct inode *inode, struct file *file)
+{
+    struct lfsm_evdev_reader *r;
+    unsigned long flags;
+    int ret;
+
+    r = kzalloc(sizeof(*r), GFP_KERNEL);
+    if (!r)
+        return -ENOMEM;
+
+    ret = kfifo_alloc(&r->ring,
+                      clamp_t(unsigned int, READ_ONCE(lfsm_event_ring), 2, LFSM_EVENT_RING_MAX),
+                      GFP_KERNEL);
+    if (ret) {
+        kfree(r);
+        return ret;
+    }
+    spin_lock_init(&r->lock);
+    init_waitqueue_head(&r->wait);
+    mutex_init(&r->read_lock);
+
+    spin_lock_irqsave(&lfsm_evdev_readers_lock, flags);
+    list_add_tail_rcu(&r->node, &lfsm_evdev_readers);
+    spin_unlock_irqrestore(&lfsm_evdev_readers_lock, flags);
+
+    file->private_data = r;
+    return stream_open(inode, file);
+}
+
+static void lfsm_evdev_free_rcu(struct rcu_head *head)
+{
+    struct lfsm_evdev_reader *r = container_of(head, struct lfsm_evdev_reader, rcu);
+
+    kfifo_free(&r->ring);
+    kfree(r);
+}
+
+/* Posters may still be walking @r, so the ring goes after a grace period */
+static int lfsm_evdev_release(struct inode *inode, struct file *file)
+{
+    struct lfsm_evdev_reader *r = file->private_data;
+    unsigned long flags;
+
+    spin_lock_irqsave(&lfsm_evdev_readers_lock, flags);
+    list_del_rcu(&r->node);
+    spin_unlock_irqrestore(&lfsm_evdev_readers_lock, flags);
+
+    call_rcu(&r->rcu, lfsm_evdev_free_rcu);
+    return 0;
+}
+
+static bool lfsm_evdev_pending(struct lfsm_evdev_reader *r)
+{
+    unsigned long flags;
+    bool pending;
+
+    spin_lock_irqsave(&r->lock, flags);
+    pending = !kfifo_is_empty(&r->ring) || r->lost;
+    spin_unlock_irqrestore(&r->lock, flags);
+    return pending;
+}
+
+/*
+ * Returns as many whole records as fit in @count and are queued, blocking
+ * for the first one unless O_NONBLOCK is set.
+ */
+static ssize_t lfsm_evdev_read(struct file *file, char __user *buf, size_t count,
+                               loff_t *ppos)
+{
+    struct lfsm_evdev_reader *r = file->private_data;
+    size_t want = count / sizeof(struct lfsm_event_record);
+    size_t done = 0;
+    unsigned int n;
+    int ret = 0;
+
+    if (!want)
+        return -EINVAL;
+
+    if (mutex_lock_interruptible(&r->read_lock))
+        return -ERESTARTSYS;
+
+    while (!lfsm_evdev_pending(r)) {
+        mutex_unlock(&r->read_lock);
+        if (file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        ret = wait_event_interruptible(r->wait, lfsm_evdev_pending(r));
+        if (ret)
+            return ret;
+        if (mutex_lock_interruptible(&r->read_lock))
+            return -ERESTARTSYS;
+    }
+
+    while (done < want) {
+        unsigned int room = min_t(size_t, want - done, LFSM_EVENT_BATCH);
+
+        n = 0;
+        spin_lock_irq(&r->lock);
+        if (r->lost) {
+            memset(&r->batch[0], 0, sizeof(r->batch[0]));
+            r->batch[0].flags = LFSM_EVREC_OVERRUN;
+            r->batch[0].lost = r->lost;
+            r->lost = 0;
+            n = 1;
+        }
+        n += kfifo_out(&r->ring, &r->batch[n], room - n);
+        spin_unlock_irq(&r->lock);
+
+        if (!n)
+            break;
+        /* Records already taken off the ring are lost if this fails */
+        if (copy_to_user(buf + done * sizeof(r->batch[0]), r->batch, n * sizeof(r->batch[0]))) {
+            ret = -EFAULT;
+            break;
+        }
+        done += n;
+    }
+    mutex_unlock(&r->read_lock);
+
+    if (!done)
+        return ret;
+    return done * sizeof(struct lfsm_event_record);
+}
+
+static __poll_t lfsm_evdev_poll(struct file *file, poll_table *wait)
+{
+    struct lfsm_evdev_reader *r = file->private_data;
+
+    poll_wait(file, &r->wait, wait);
+    return lfsm_evdev_pending(r) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+static const struct file_operations lfsm_evdev_fops = {
+    .owner = THIS_MODULE,
+    .open = lfsm_evdev_open,
+    .release = lfsm_evdev_release,
+    .read = lfsm_evdev_read,
+    .poll = lfsm_evdev_poll,
+};
+
+static struct miscdevice lfsm_evdev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = "lfsm_events",
+    .fops = &lfsm_evdev_fops,
+    .mode = 0444,
+};
+
+// --- Subscribers ---
+
+/*
+ * Two subscriber lists, each ordered by notifier_block priority like a
+ * regular notifier chain. Blocking subscribers run from a worker after the
+ * state change, under lfsm_blocking_subs_rwsem. Atomic subscribers run
+ * under RCU straight from the context that changed the state, which may be
+ * hard IRQ. Every subscriber keeps its own call count and run time, shown
+ * in /sys/kernel/lfsm/subscribers.
+ */
+struct lfsm_subscriber {
+    struct list_head node;
+    struct notifier_block *nb;
+    atomic64_t calls;
+    atomic64_t total_ns;
+    atomic64_t max_ns;
+    struct rcu_head rcu;
+};
+
+static LIST_HEAD(lfsm_blocking_subs);
+static DECLARE_RWSEM(lfsm_blocking_subs_rwsem);
+static LIST_HEAD(lfsm_atomic_subs);
+static DEFINE_SPINLOCK(lfsm_atomic_subs_lock);
+
+/*
+ * Held for reading across every blocking subscriber call, serial or
+ * parallel, and taken for writing by the unregister path, so lockdep
+ * reports a subscriber that unregisters from its own callback.
+ */
+#ifdef CONFIG_LOCKDEP
+static struct lockdep_map lfsm_blocking_call_map =
+    STATIC_LOCKDEP_MAP_INIT("lfsm_blocking_call", &lfsm_blocking_call_map);
+#endif
+
+static void lfsm_subscriber_account(struct lfsm_subscriber *sub, u64 ns)
+{
+    s64 max = atomic64_read(&sub->max_ns);
+
+    atomic64_inc(&sub->calls);
+    atomic64_add(ns, &sub->total_ns);
+    while (ns > max) {
+        s64 old = atomic64_cmpxchg(&sub->max_ns, max, ns);
+
+        if (old == max)
+            break;
+        max = old;
+    }
+}
+
+/* Returns the callback's NOTIFY_* result */
+static int lfsm_subscriber_call(struct lfsm_subscriber *sub, const struct lfsm_event *ev)
+{
+    u64 start = ktime_get_ns();
+    int ret;
+
+    ret = sub->nb->notifier_call(sub->nb, ev->new_state, (void *)ev);
+    lfsm_subscriber_account(sub, ktime_get_ns() - start);
+    return ret;
+}
+
+static int lfsm_blocking_subscriber_call(struct lfsm_subscriber *sub,
+                                         const struct lfsm_event *ev)
+{
+    int ret;
+
+    lock_map_acquire_read(&lfsm_blocking_call_map);
+    ret = lfsm_subscriber_call(sub, ev);
+    lock_map_release(&lfsm_blocking_call_map);
+    return ret;
+}
+
+/*
+ * With notify_parallel set, each blocking subscriber gets its own work item
+ * on lfsm_notify_wq, so the time to notify is that of the slowest subscriber
+ * rather than the sum of all of them. NOTIFY_STOP_MASK has no effect in this
+ * mode. The fan-out is freed by whichever call finishes last, which also
+ * kicks the dispatcher if the FSM is waiting on it.
+ */
+struct lfsm_fanout_call {
+    struct work_struct work;
+    struct lfsm_fanout *fanout;
+    struct lfsm_subscriber *sub;
+};
+
+struct lfsm_fanout {
+    struct lfsm_event ev;
+    atomic_t pending;
+    bool kick; /* last call queues the instance's dispatcher */
+    u64 start_ns;
+    struct lfsm_fanout_call calls[];
+};
+
+static void lfsm_fanout_worker(struct work_struct *work)
+{
+    struct lfsm_fanout_call *call = container_of(work, struct lfsm_fanout_call, work);
+    struct lfsm_fanout *fanout = call->fanout;
+
+    lfsm_blocking_subscriber_call(call->sub, &fanout->ev);
+    if (!atomic_dec_and_test(&fanout->pending))
+        return;
+
+    if (fanout->kick) {
+        lfsm_hist_add(LFSM_HIST_NOTIFY, ktime_get_ns() - fanout->start_ns);
+        lfsm_queue_work(fanout->ev.inst, &fanout->ev.inst->worker);
+    }
+    kobject_put(&fanout->ev.inst->kobj);
+    kfree(fanout);
+}
+
+/* Caller holds the list's writer lock */
+static int lfsm_subscriber_add(struct list_head *subs, struct lfsm_subscriber *sub)
+{
+    struct lfsm_subscriber *pos;
+
+    list_for_each_entry(pos, subs, node) {
+        if (pos->nb == sub->nb)
+            return -EEXIST;
+    }
+    list_for_each_entry(pos, subs, node) {
+        if (sub->nb->priority > pos->nb->priority)
+            break;
+    }
+    /* Inserts before @pos, or at the tail if the loop ran off the end */
+    list_add_tail_rcu(&sub->node, &pos->node);
+    return 0;
+}
+
+/* Caller holds the list's writer lock */
+static struct lfsm_subscriber *lfsm_subscriber_find(struct list_head *subs,
+                                                    struct notifier_block *nb)
+{
+    struct lfsm_subscriber *sub;
+
+    list_for_each_entry(sub, subs, node) {
+        if (sub->nb == nb)
+            return sub;
+    }
+    return NULL;
+}
+
+/*
+ * Blocking subscribers are called with the new enum link_state as @val and
+ * a const struct lfsm_event describing the change as @data. The event is
+ * only valid for the duration of the call.
+ */
+int lfsm_register_link_state_notifier(struct notifier_block *nb) {
+    struct lfsm_subscriber *sub;
+    int ret;
+
+    sub = kzalloc(sizeof(*sub), GFP_KERNEL);
+    if (!sub)
+        return -ENOMEM;
+    sub->nb = nb;
+
+    down_write(&lfsm_blocking_subs_rwsem);
+    ret = lfsm_subscriber_add(&lfsm_blocking_subs, sub);
+    up_write(&lfsm_blocking_subs_rwsem);
+
+    if (ret)
+        kfree(sub);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(lfsm_register_link_state_notifier);
+
+/**
+ * lfsm_unregister_link_state_notifier - Undo lfsm_register_link_state_notifier().
+ * @nb: Notifier block passed to lfsm_register_link_state_notifier().
+ *
+ * Waits for calls already running or queued for @nb, serial or parallel,
+ * so @nb may be freed once this returns. A subscriber must therefore not
+ * unregister itself from its own callback: the wait would never finish.
+ * Lockdep reports that case, and from a parallel fan-out call it is
+ * refused with -EDEADLK instead of hanging.
+ *
+ * Context: Process context, may sleep. Not from a blocking subscriber.
+ * Return: 0 on success, -ENOENT if @nb is not registered, -EDEADLK if
+ * called from a parallel subscriber call.
+ */
+int lfsm_unregister_link_state_notifier(struct notifier_block *nb) {
+    struct lfsm_subscriber *sub;
+    struct work_struct *work = current_work();
+
+    might_sleep();
+    if (WARN_ON_ONCE(work && work->func == lfsm_fanout_worker))
+        return -EDEADLK;
+    lock_map_acquire(&lfsm_blocking_call_map);
+    lock_map_release(&lfsm_blocking_call_map);
+
+    down_write(&lfsm_blocking_subs_rwsem);
+    sub = lfsm_subscriber_find(&lfsm_blocking_subs, nb);
+    if (sub)
+        list_del(&sub->node);
+    up_write(&lfsm_blocking_subs_rwsem);
+
+    if (!sub)
+        return -ENOENT;
+    /* Parallel calls already queued for @sub must finish before it goes */
+    flush_workqueue(lfsm_notify_wq);
+    kfree(sub);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(lfsm_unregister_link_state_notifier);
+
+/**
+ * lfsm_register_atomic_link_state_notifier - Subscribe from atomic context.
+ * @nb: Notifier block, called as for lfsm_register_link_state_notifier().
+ *
+ * The callback runs as soon as an instance settles in its new state, with
+ * no instance lock held but possibly in hard IRQ context, and must not
+ * sleep. It is called before any blocking subscriber sees the same event.
+ *
+ * Context: Process context.
+ * Return: 0 on success, -EEXIST if @nb is already registered, -ENOMEM.
+ */
+int lfsm_register_atomic_link_state_notifier(struct notifier_block *nb)
+{
+    struct lfsm_subscriber *sub;
+    unsigned long flags;
+    int ret;
+
+    sub = kzalloc(sizeof(*sub), GFP_KERNEL);
+    if (!sub)
+        return -ENOMEM;
+    sub->nb = nb;
+
+    spin_lock_irqsave(&lfsm_atomic_subs_lock, flags);
+    ret = lfsm_subscriber_add(&lfsm_atomic_subs, sub);
+    spin_unlock_irqrestore(&lfsm_atomic_subs_lock, flags);
+
+    if (ret)
+        kfree(sub);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(lfsm_register_atomic_link_state_notifier);
+
+/**
+ * lfsm_unregister_atomic_link_state_notifier - Undo the atomic registration.
+ * @nb: Notifier block passed to lfsm_register_atomic_link_state_notifier().
+ *
+ * Waits for callbacks already running on other CPUs, so @nb may be freed
+ * once this returns.
+ *
+ * Context: Process context, may sleep.
+ * Return: 0 on success, -ENOENT if @nb is not registered.
+ */
+int lfsm_unregister_atomic_link_state_notifier(struct notifier_block *nb)
+{
+    struct lfsm_subscriber *sub;
+    unsigned long flags;
+
+    spin_lock_irqsave(&lfsm_atomic_subs_lock, flags);
+    sub = lfsm_subscriber_find(&lfsm_atomic_subs, nb);
+    if (sub)
+        list_del_rcu(&sub->node);
+    spin_unlock_irqrestore(&lfsm_atomic_subs_lock, flags);
+
+    if (!sub)
+        return -ENOENT;
+    synchronize_rcu();
+    kfree(sub);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(lfsm_unregister_atomic_link_state_notifier);
+
+/* Any context, no instance locks held */
+static void lfsm_call_atomic_subscribers(const struct lfsm_event *ev)
+{
+    struct lfsm_subscriber *sub;
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(sub, &lfsm_atomic_subs, node) {
+        if (lfsm_subscriber_call(sub, ev) & NOTIFY_STOP_MASK)
+            break;
+    }
+    rcu_read_unlock();
+}
+
+/*
+ * Any context, no instance locks held. Tells everything that must hear of
+ * @ev at once: event device readers, poll() on the state files, atomic
+ * subscribers and the instance's dependencies.
+ */
+static void lfsm_event_settled(const struct lfsm_event *ev)
+{
+    lfsm_evdev_post(ev);
+    lfsm_state_notify(ev->inst);
+    lfsm_call_atomic_subscribers(ev);
+    lfsm_dep_settled(ev->inst);
+}
+
+/*
+ * Caller holds lfsm_blocking_subs_rwsem for reading. Returns 1 if the
+ * fan-out took over kicking the dispatcher, 0 if the caller still has to,
+ * or -ENOMEM if the calls must be made serially instead.
+ */
+static int lfsm_fanout_blocking_subscribers(const struct lfsm_event *ev, bool kick, u64 start)
+{
+    struct lfsm_fanout *fanout;
+    struct lfsm_subscriber *sub;
+    unsigned int n = 0, i = 0;
+
+    lockdep_assert_held(&lfsm_blocking_subs_rwsem);
+    list_for_each_entry(sub, &lfsm_blocking_subs, node)
+        n++;
+    if (!n)
+        return 0;
+
+    fanout = kzalloc(struct_size(fanout, calls, n), GFP_KERNEL);
+    if (!fanout)
+        return -ENOMEM;
+
+    fanout->ev = *ev;
+    /* A netlink CANCEL racing with destroy may outlive destroy's flush */
+    kobject_get(&ev->inst->kobj);
+    fanout->kick = kick && READ_ONCE(lfsm_notify_wait);
+    fanout->start_ns = start;
+    atomic_set(&fanout->pending, n);
+    kick = fanout->kick; /* @fanout may be gone once the last call is queued */
+
+    list_for_each_entry(sub, &lfsm_blocking_subs, node) {
+        fanout->calls[i].fanout = fanout;
+        fanout->calls[i].sub = sub;
+        INIT_WORK(&fanout->calls[i].work, lfsm_fanout_worker);
+        i++;
+    }
+    for (i = 0; i < n; i++)
+        queue_work(lfsm_notify_wq, &fanout->calls[i].work);
+
+    return kick;
+}
+
+/*
+ * Process context, no instance locks held. @kick says the caller wants the
+ * dispatcher queued once subscribers are done; returns true if that has been
+ * handed off to a parallel fan-out.
+ */
+static bool lfsm_call_blocking_subscribers(const struct lfsm_event *ev, bool kick, u64 start)
+{
+    struct lfsm_subscriber *sub;
+    int ret;
+
+    down_read(&lfsm_blocking_subs_rwsem);
+    if (READ_ONCE(lfsm_notify_parallel)) {
+        ret = lfsm_fanout_blocking_subscribers(ev, kick, start);
+        if (ret >= 0) {
+            up_read(&lfsm_blocking_subs_rwsem);
+            return ret;
+        }
+    }
+
+    list_for_each_entry(sub, &lfsm_blocking_subs, node) {
+        if (lfsm_blocking_subscriber_call(sub, ev) & NOTIFY_STOP_MASK)
+            break;
+    }
+    up_read(&lfsm_blocking_subs_rwsem);
+    return false;
+}
+
+/* Generic Netlink Definitions */
+static struct genl_family lfsm_genl_family;
+
+enum {
+    LFSM_ATTR_UNSPEC,
+    LFSM_ATTR_LINK_STATE,
+    LFSM_ATTR_INSTANCE_ID,
+    LFSM_ATTR_DELAY_MS,
+    LFSM_ATTR_TIMEOUT_MS,
+    LFSM_ATTR_BATCH,      /* nest of LFSM_ATTR_BATCH_ENTRY */
+    LFSM_ATTR_BATCH_ENTRY, /* nest: INSTANCE_ID, LINK_STATE, STATUS */
+    LFSM_ATTR_STATUS,
+    LFSM_ATTR_PAD,
+    LFSM_ATTR_STATS,        /* nest: u64 counter per enum lfsm_stat, type = index + 1 */
+    LFSM_ATTR_HIST,         /* nest: HIST_ID, HIST_BUCKETS */
+    LFSM_ATTR_HIST_ID,
+    LFSM_ATTR_HIST_BUCKETS, /* nest: u64 count per bucket, type = index + 1 */
+    LFSM_ATTR_NAME,
+    LFSM_ATTR_GEN,
+    LFSM_ATTR_QUEUE_LEN,
+    LFSM_ATTR_QUEUE_DEPTH,
+    LFSM_ATTR_COALESCE,
+    LFSM_ATTR_OVERFLOW_POLICY,
+    LFSM_ATTR_OLD_STATE,
+    LFSM_ATTR_CAUSE,
+    LFSM_ATTR_TIMESTAMP,
+    LFSM_ATTR_SEQ,
+    LFSM_ATTR_STATE_NAME,   /* table name of LINK_STATE */
+    LFSM_ATTR_URGENT,       /* flag: LINK_UP/LINK_DOWN on the priority lane */
+    LFSM_ATTR_FILTER_IDS,   /* nest: u32 instance id per entry */
+    LFSM_ATTR_FILTER_STATES, /* u64: bit per new state */
+    LFSM_ATTR_ACTIONS,      /* nest: u32 trigger per pending action, type = index + 1 */
+    LFSM_ATTR_N_URGENT,     /* u32: leading ACTIONS that go on the priority lane */
+    __LFSM_ATTR_MAX,
+};
+#define LFSM_ATTR_MAX (__LFSM_ATTR_MAX - 1)
+
+static struct nla_policy lfsm_nl_policy[LFSM_ATTR_MAX + 1] = {
+    [LFSM_ATTR_LINK_STATE] = { .type = NLA_U32 },
+    [LFSM_ATTR_INSTANCE_ID] = { .type = NLA_U32 },
+    [LFSM_ATTR_DELAY_MS] = { .type = NLA_U32 },
+    [LFSM_ATTR_TIMEOUT_MS] = { .type = NLA_U32 },
+    [LFSM_ATTR_BATCH] = { .type = NLA_NESTED },
+    [LFSM_ATTR_BATCH_ENTRY] = { .type = NLA_NESTED },
+    [LFSM_ATTR_STATUS] = { .type = NLA_S32 },
+    [LFSM_ATTR_URGENT] = { .type = NLA_FLAG },
+    [LFSM_ATTR_FILTER_IDS] = { .type = NLA_NESTED },
+    [LFSM_ATTR_FILTER_STATES] = { .type = NLA_U64 },
+    [LFSM_ATTR_NAME] = { .type = NLA_NUL_STRING, .len = LFSM_NAME_LEN - 1 },
+    [LFSM_ATTR_STATE_NAME] = { .type = NLA_NUL_STRING },
+    [LFSM_ATTR_QUEUE_DEPTH] = { .type = NLA_U32 },
+    [LFSM_ATTR_COALESCE] = { .type = NLA_U8 },
+    [LFSM_ATTR_OVERFLOW_POLICY] = { .type = NLA_U32 },
+    [LFSM_ATTR_ACTIONS] = { .type = NLA_NESTED },
+    [LFSM_ATTR_N_URGENT] = { .type = NLA_U32 },
+};
+
+#define LFSM_BATCH_MAX 4096
+
+enum {
+    LFSM_CMD_UNSPEC,
+    LFSM_CMD_NOTIFY,
+    LFSM_CMD_LINK_UP,
+    LFSM_CMD_LINK_DOWN,
+    LFSM_CMD_CANCEL,
+    LFSM_CMD_SET_CONFIG,
+    LFSM_CMD_LINK_SET_BATCH,
+    LFSM_CMD_GET_STATS,
+    LFSM_CMD_GET,
+    LFSM_CMD_SUBSCRIBE,
+    LFSM_CMD_UNSUBSCRIBE,
+    LFSM_CMD_CHECKPOINT,
+    LFSM_CMD_RESTORE,
+    __LFSM_CMD_MAX,
+};
+#define LFSM_CMD_MAX (__LFSM_CMD_MAX - 1)
+
+enum {
+    LFSM_MCGRP_EVENTS,
+};
+
+static const struct genl_multicast_group lfsm_mcgrps[] = {
+    [LFSM_MCGRP_EVENTS] = { .name = "lfsm_events" },
+};
+
+/*
+ * NOTIFY messages are small and fixed-size, so they are allocated to fit
+ * and without entering reclaim. When that fails, a message is taken from
+ * a small pool of preallocated ones, which a work item tops up again.
+ */
+#define LFSM_NOTIFY_RESERVE 16
+
+static struct sk_buff_head lfsm_notify_pool;
+static bool lfsm_nl_registered;
+
+static size_t lfsm_notify_size(void)
+{
+    return nla_total_size(sizeof(u32)) +       /* LFSM_ATTR_INSTANCE_ID */
+           nla_total_size(sizeof(u32)) +       /* LFSM_ATTR_LINK_STATE */
+           nla_total_size(sizeof(u32)) +       /* LFSM_ATTR_OLD_STATE */
+           nla_total_size(sizeof(u32)) +       /* LFSM_ATTR_CAUSE */
+           nla_total_size_64bit(sizeof(u64)) + /* LFSM_ATTR_TIMESTAMP */
+           nla_total_size_64bit(sizeof(u64));  /* LFSM_ATTR_SEQ */
+}
+
+static void lfsm_notify_pool_refill(struct work_struct *work)
+{
+    struct sk_buff *skb;
+
+    while (skb_queue_len(&lfsm_notify_pool) < LFSM_NOTIFY_RESERVE) {
+        skb = genlmsg_new(lfsm_notify_size(), GFP_KERNEL);
+        if (!skb)
+            break;
+        skb_queue_tail(&lfsm_notify_pool, skb);
+    }
+}
+static DECLARE_WORK(lfsm_notify_pool_work, lfsm_notify_pool_refill);
+
+static struct sk_buff *lfsm_notify_alloc(void)
+{
+    struct sk_buff *skb;
+
+    skb = genlmsg_new(lfsm_notify_size(), GFP_NOWAIT | __GFP_NOWARN);
+    if (skb)
+        return skb;
+
+    skb = skb_dequeue(&lfsm_notify_pool);
+    if (skb) {
+        lfsm_stat_inc(LFSM_STAT_NOTIFY_RESERVE);
+        queue_work(lfsm_wqs[LFSM_WQ_UNBOUND], &lfsm_notify_pool_work);
+    } else {
+        lfsm_stat_inc(LFSM_STAT_NOTIFY_DROPPED);
+        pr_warn_ratelimited("LFSM: Dropped link state notification\n");
+    }
+    return skb;
+}
+
+/*
+ * A socket that SUBSCRIBEs gets NOTIFY messages by unicast, and only for
+ * the instances and new states its filter names, rather than joining
+ * lfsm_events and discarding most of every event in user space. Each
+ * port has at most one filter, dropped again by UNSUBSCRIBE or when the
+ * socket is closed.
+ */
+#define LFSM_FILTER_MAX_IDS 1024
+
+struct lfsm_nl_filter {
+    struct list_head node;
+    u32 portid;
+    u64 states;         /* bit per new state, 0 for all */
+    unsigned int n_ids; /* 0 for every instance */
+    u32 ids[];          /* sorted */
+};
+
+static LIST_HEAD(lfsm_nl_filters);
+static DEFINE_MUTEX(lfsm_nl_filters_lock);
+
+static int lfsm_u32_cmp(const void *a, const void *b)
+{
+    u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static bool lfsm_nl_filter_match(const struct lfsm_nl_filter *f, const struct lfsm_event *ev)
+{
+    if (f->states && !(f->states & BIT_ULL(ev->new_state)))
+        return false;
+    return !f->n_ids || bsearch(&ev->inst->id, f->ids, f->n_ids, sizeof(u32), lfsm_u32_cmp);
+}
+
+/* Sends a copy of the NOTIFY message @skb to every filter matching @ev */
+static void lfsm_notify_filtered(struct sk_buff *skb, const struct lfsm_event *ev)
+{
+    struct lfsm_nl_filter *f;
+    struct sk_buff *copy;
+
+    mutex_lock(&lfsm_nl_filters_lock);
+    list_for_each_entry(f, &lfsm_nl_filters, node) {
+        if (!lfsm_nl_filter_match(f, ev))
+            continue;
+        copy = skb_clone(skb, GFP_KERNEL);
+        if (!copy) {
+            lfsm_stat_inc(LFSM_STAT_NOTIFY_DROPPED);
+            continue;
+        }
+        /* Never blocks; a full receive queue shows up as a SEQ gap */
+        genlmsg_unicast(&init_net, copy, f->portid);
+    }
+    mutex_unlock(&lfsm_nl_filters_lock);
+}
+
+/* Installs @f, or none if NULL, as @portid's filter */
+static void lfsm_nl_filter_set(u32 portid, struct lfsm_nl_filter *f)
+{
+    struct lfsm_nl_filter *old;
+
+    mutex_lock(&lfsm_nl_filters_lock);
+    list_for_each_entry(old, &lfsm_nl_filters, node) {
+        if (old->portid == portid) {
+            list_del(&old->node);
+            kfree(old);
+            break;
+        }
+    }
+    if (f)
+        list_add_tail(&f->node, &lfsm_nl_filters);
+    mutex_unlock(&lfsm_nl_filters_lock);
+}
+
+static int lfsm_nl_release(struct notifier_block *nb, unsigned long event, void *ptr)
+{
+    struct netlink_notify *n = ptr;
+
+    if (event == NETLINK_URELEASE && n->protocol == NETLINK_GENERIC &&
+        net_eq(n->net, &init_net))
+        lfsm_nl_filter_set(n->portid, NULL);
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block lfsm_nl_notifier = {
+    .notifier_call = lfsm_nl_release,
+};
+
+static void lfsm_nl_filters_free(void)
+{
+    struct lfsm_nl_filter *f, *tmp;
+
+    mutex_lock(&lfsm_nl_filters_lock);
+    list_for_each_entry_safe(f, tmp, &lfsm_nl_filters, node) {
+        list_del(&f->node);
+        kfree(f);
+    }
+    mutex_unlock(&lfsm_nl_filters_lock);
+}
+
+/* Process context */
+static void lfsm_notify_state(const struct lfsm_event *ev) {
+    struct sk_buff *skb;
+    bool mcast, filtered;
+    void *msg_head;
+
+    if (!READ_ONCE(lfsm_nl_registered))
+        return;
+    mcast = genl_has_listeners(&lfsm_genl_family, &init_net, LFSM_MCGRP_EVENTS);
+    filtered = !list_empty(&lfsm_nl_filters);
+    if (!mcast && !filtered)
+        return;
+
+    skb = lfsm_notify_alloc();
+    if (!skb)
+        return;
+
+    msg_head = genlmsg_put(skb, 0, 0, &lfsm_genl_family, 0, LFSM_CMD_NOTIFY);
+    if (!msg_head)
+        goto free;
+
+    if (nla_put_u32(skb, LFSM_ATTR_INSTANCE_ID, ev->inst->id) ||
+        nla_put_u32(skb, LFSM_ATTR_LINK_STATE, ev->new_state) ||
+        nla_put_u32(skb, LFSM_ATTR_OLD_STATE, ev->old_state) ||
+        nla_put_u32(skb, LFSM_ATTR_CAUSE, ev->cause) ||
+        nla_put_u64_64bit(skb, LFSM_ATTR_TIMESTAMP, ev->timestamp_ns, LFSM_ATTR_PAD) ||
+        nla_put_u64_64bit(skb, LFSM_ATTR_SEQ, ev->seq, LFSM_ATTR_PAD))
+        goto free;
+
+    genlmsg_end(skb, msg_head);
+    if (filtered)
+        lfsm_notify_filtered(skb, ev);
+    if (mcast) {
+        genlmsg_multicast(&lfsm_genl_family, skb, 0, LFSM_MCGRP_EVENTS, GFP_KERNEL);
+        return;
+    }
+free:
+    nlmsg_free(skb);
+}
+
+/* Caller holds lfsm_instances_lock */
+static struct lfsm_instance *lfsm_find_instance(u32 id)
+{
+    lockdep_assert_held(&lfsm_instances_lock);
+    return xa_load(&lfsm_instances_xa, id);
+}
+
+static int lfsm_cmd_set_config(struct lfsm_instance *inst, struct genl_info *info)
+{
+    int ret;
+
+    /* Validate the timeout first so a rejected request changes nothing */
+    if (info->attrs[LFSM_ATTR_TIMEOUT_MS]) {
+        ret = lfsm_instance_set_timeout_ms(inst, nla_get_u32(info->attrs[LFSM_ATTR_TIMEOUT_MS]));
+        if (ret)
+            return ret;
+    }
+    if (info->attrs[LFSM_ATTR_DELAY_MS])
+        lfsm_instance_set_delay_ms(inst, nla_get_u32(info->attrs[LFSM_ATTR_DELAY_MS]));
+    return 0;
+}
+
+/*
+ * The instance is only pinned, not held against destruction, while the
+ * command runs: force_down and direct dispatch sleep on workqueues, the
+ * subscribers and the driver op, none of which may happen under
+ * lfsm_instances_lock. A command racing with destroy gets -ENODEV from
+ * the request paths or acts on an instance that no longer runs.
+ */
+static int lfsm_cmd_handler(struct sk_buff *skb, struct genl_info *info) {
+    struct lfsm_instance *inst;
+    int ret;
+
+    if (!info)
+        return -EINVAL;
+
+    mutex_lock(&lfsm_instances_lock);
+    if (info->attrs[LFSM_ATTR_INSTANCE_ID])
+        inst = lfsm_find_instance(nla_get_u32(info->attrs[LFSM_ATTR_INSTANCE_ID]));
+    else
+        inst = lfsm_default;
+    if (inst)
+        kobject_get(&inst->kobj);
+    mutex_unlock(&lfsm_instances_lock);
+    if (!inst)
+        return -ENODEV;
+
+    switch (info->genlhdr->cmd) {
+    case LFSM_CMD_LINK_UP:
+        if (nla_get_flag(info->attrs[LFSM_ATTR_URGENT]))
+            ret = lfsm_instance_link_up_urgent(inst);
+        else
+            ret = lfsm_instance_link_up_sync(inst);
+        break;
+    case LFSM_CMD_LINK_DOWN:
+        if (nla_get_flag(info->attrs[LFSM_ATTR_URGENT]))
+            ret = lfsm_instance_link_down_urgent(inst);
+        else
+            ret = lfsm_instance_link_down_sync(inst);
+        break;
+    case LFSM_CMD_CANCEL:
+        lfsm_instance_force_down(inst);
+        ret = 0;
+        break;
+    case LFSM_CMD_SET_CONFIG:
+        ret = lfsm_cmd_set_config(inst, info);
+        break;
+    default:
+        ret = -EOPNOTSUPP;
+        break;
+    }
+    kobject_put(&inst->kobj);
+    return ret;
+}
+
+static int lfsm_nl_fill_instance(struct sk_buff *skb, struct lfsm_instance *inst,
+                                 u32 portid, u32 seq, int flags)
+{
+    unsigned int qlen, depth, delay_ms, timeout_ms;
+    enum lfsm_overflow_policy policy;
+    enum link_state state;
+    void *msg_head;
+    bool coalesce;
+    u64 gen;
+
+    lfsm_lock_irq(inst);
+    state = lfsm_instance_get_link_state_gen(inst, &gen);
+    qlen = kfifo_len(&inst->queue);
+    depth = kfifo_size(&inst->queue);
+    delay_ms = inst->delay_ms;
+    timeout_ms = inst->timeout_ms;
+    coalesce = inst->coalesce;
+    policy = inst->overflow_policy;
+    spin_unlock_irq(&inst->lock);
+
+    msg_head = genlmsg_put(skb, portid, seq, &lfsm_genl_family, flags, LFSM_CMD_GET);
+    if (!msg_head)
+        return -EMSGSIZE;
+
+    if (nla_put_u32(skb, LFSM_ATTR_INSTANCE_ID, inst->id) ||
+        nla_put_string(skb, LFSM_ATTR_NAME, inst->name) ||
+        nla_put_u32(skb, LFSM_ATTR_LINK_STATE, state) ||
+        nla_put_string(skb, LFSM_ATTR_STATE_NAME, lfsm_instance_state_name(inst, state)) ||
+        nla_put_u64_64bit(skb, LFSM_ATTR_GEN, gen, LFSM_ATTR_PAD) ||
+        nla_put_u32(skb, LFSM_ATTR_DELAY_MS, delay_ms) ||
+        nla_put_u32(skb, LFSM_ATTR_TIMEOUT_MS, timeout_ms) ||
+        nla_put_u32(skb, LFSM_ATTR_QUEUE_LEN, qlen) ||
+        nla_put_u32(skb, LFSM_ATTR_QUEUE_DEPTH, depth) ||
+        nla_put_u8(skb, LFSM_ATTR_COALESCE, coalesce) ||
+        nla_put_u32(skb, LFSM_ATTR_OVERFLOW_POLICY, policy)) {
+        genlmsg_cancel(skb, msg_head);
+        return -EMSGSIZE;
+    }
+
+    genlmsg_end(skb, msg_head);
+    return 0;
+}
+
+/* GET without NLM_F_DUMP: the instance named by INSTANCE_ID, or the default */
+static int lfsm_cmd_get(struct sk_buff *skb, struct genl_info *info)
+{
+    struct lfsm_instance *inst;
+    struct sk_buff *msg;
+    int ret;
+
+    msg = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+    if (!msg)
+        return -ENOMEM;
+
+    mutex_lock(&lfsm_instances_lock);
+    if (info->attrs[LFSM_ATTR_INSTANCE_ID])
+        inst = lfsm_find_instance(nla_get_u32(info->attrs[LFSM_ATTR_INSTANCE_ID]));
+    else
+        inst = lfsm_default;
+    if (inst)
+        ret = lfsm_nl_fill_instance(msg, inst, info->snd_portid, info->snd_seq, 0);
+    else
+        ret = -ENODEV;
+    mutex_unlock(&lfsm_instances_lock);
+
+    if (ret) {
+        nlmsg_free(msg);
+        return ret;
+    }
+    return genlmsg_reply(msg, info);
+}
+
+/*
+ * GET with NLM_F_DUMP: one message per instance. cb->args[0] holds the
+ * number of instances already sent, so a dump interrupted by a full skb
+ * resumes where it stopped.
+ */
+static int lfsm_cmd_dump(struct sk_buff *skb, struct netlink_callback *cb)
+{
+    struct lfsm_instance *inst;
+    long idx = 0, start = cb->args[0];
+
+    mutex_lock(&lfsm_instances_lock);
+    list_for_each_entry(inst, &lfsm_instances, node) {
+        if (idx < start) {
+            idx++;
+            continue;
+        }
+        if (lfsm_nl_fill_instance(skb, inst, NETLINK_CB(cb->skb).portid,
+                                  cb->nlh->nlmsg_seq, NLM_F_MULTI))
+            break;
+        idx++;
+    }
+    mutex_unlock(&lfsm_instances_lock);
+
+    cb->args[0] = idx;
+    return skb->len;
+}
+
+static int lfsm_batch_reply(struct genl_info *info, struct lfsm_batch_entry *ents,
+                            u32 *ids, unsigned int n)
+{
+    struct nlattr *batch, *entry;
+    struct sk_buff *skb;
+    void *msg_head;
+    unsigned int i;
+
+    skb = genlmsg_new(nla_total_size(0) +
+                      n * (nla_total_size(0) + 2 * nla_total_size(sizeof(u32))),
+                      GFP_KERNEL);
+    if (!skb)
+        return -ENOMEM;
+
+    msg_head = genlmsg_put_reply(skb, info, &lfsm_genl_family, 0, LFSM_CMD_LINK_SET_BATCH);
+    if (!msg_head)
+        goto nospace;
+
+    batch = nla_nest_start(skb, LFSM_ATTR_BATCH);
+    if (!batch)
+        goto nospace;
+    for (i = 0; i < n; i++) {
+        entry = nla_nest_start(skb, LFSM_ATTR_BATCH_ENTRY);
+        if (!entry ||
+            nla_put_u32(skb, LFSM_ATTR_INSTANCE_ID, ids[i]) ||
+            nla_put_s32(skb, LFSM_ATTR_STATUS, ents[i].status))
+            goto nospace;
+        nla_nest_end(skb, entry);
+    }
+    nla_nest_end(skb, batch);
+
+    genlmsg_end(skb, msg_head);
+    return genlmsg_reply(skb, info);
+
+nospace:
+    nlmsg_free(skb);
+    return -EMSGSIZE;
+}
+
+/*
+ * LINK_SET_BATCH carries a BATCH nest of BATCH_ENTRY nests, each holding an
+ * INSTANCE_ID and a target LINK_STATE. The reply echoes every INSTANCE_ID
+ * with its STATUS; the command itself fails only for malformed requests.
+ */
+static int lfsm_cmd_set_batch(struct sk_buff *skb, struct genl_info *info)
+{
+    struct nlattr *tb[LFSM_ATTR_MAX + 1];
+    struct lfsm_batch_entry *ents;
+    struct nlattr *entry;
+    unsigned int n = 0, i;
+    u32 *ids;
+    int rem, ret;
+
+    if (!info->attrs[LFSM_ATTR_BATCH])
+        return -EINVAL;
+
+    nla_for_each_nested(entry, info->attrs[LFSM_ATTR_BATCH], rem)
+        n++;
+    if (!n || n > LFSM_BATCH_MAX)
+        return -EINVAL;
+
+    ents = kcalloc(n, sizeof(*ents), GFP_KERNEL);
+    ids = kcalloc(n, sizeof(*ids), GFP_KERNEL);
+    if (!ents || !ids) {
+        ret = -ENOMEM;
+        goto free;
+    }
+
+    mutex_lock(&lfsm_instances_lock);
+    i = 0;
+    nla_for_each_nested(entry, info->attrs[LFSM_ATTR_BATCH], rem) {
+        ret = nla_parse_nested(tb, LFSM_ATTR_MAX, entry, lfsm_nl_policy, info->extack);
+        if (ret)
+            goto unlock;
+        if (!tb[LFSM_ATTR_INSTANCE_ID] || !tb[LFSM_ATTR_LINK_STATE]) {
+            NL_SET_ERR_MSG(info->extack, "batch entry needs INSTANCE_ID and LINK_STATE");
+            ret = -EINVAL;
+            goto unlock;
+        }
+        ids[i] = nla_get_u32(tb[LFSM_ATTR_INSTANCE_ID]);
+        ents[i].inst = lfsm_find_instance(ids[i]);
+        ents[i].target = nla_get_u32(tb[LFSM_ATTR_LINK_STATE]);
+        i++;
+    }
+
+    lfsm_link_set_batch(ents, n);
+    mutex_unlock(&lfsm_instances_lock);
+
+    ret = lfsm_batch_reply(info, ents, ids, n);
+    goto free;
+
+unlock:
+    mutex_unlock(&lfsm_instances_lock);
+free:
+    kfree(ids);
+    kfree(ents);
+    return ret;
+}
+
+static int lfsm_nl_put_u64_array(struct sk_buff *skb, int attrtype, const u64 *vals, int n)
+{
+    struct nlattr *nest;
+    int i;
+
+    nest = nla_nest_start(skb, attrtype);
+    if (!nest)
+        return -EMSGSIZE;
+    for (i = 0; i < n; i++) {
+        if (nla_put_u64_64bit(skb, i + 1, vals[i], LFSM_ATTR_PAD)) {
+            nla_nest_cancel(skb, nest);
+            return -EMSGSIZE;
+        }
+    }
+    nla_nest_end(skb, nest);
+    return 0;
+}
+
+/* Single-message dump of the module-wide counters and histograms */
+static int lfsm_cmd_dump_stats(struct sk_buff *skb, struct netlink_callback *cb)
+{
+    struct lfsm_stats *sum;
+    struct nlattr *hist;
+    void *msg_head;
+    int i, ret = -EMSGSIZE;
+
+    if (cb->args[0])
+        return 0;
+
+    sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+    if (!sum)
+        return -ENOMEM;
+    lfsm_stats_sum(sum);
+
+    msg_head = genlmsg_put(skb, NETLINK_CB(cb->skb).portid, cb->nlh->nlmsg_seq,
+                           &lfsm_genl_family, NLM_F_MULTI, LFSM_CMD_GET_STATS);
+    if (!msg_head)
+        goto out;
+
+    if (lfsm_nl_put_u64_array(skb, LFSM_ATTR_STATS, sum->count, LFSM_STAT_MAX))
+        goto cancel;
+    for (i = 0; i < LFSM_HIST_MAX; i++) {
+        hist = nla_nest_start(skb, LFSM_ATTR_HIST);
+        if (!hist ||
+            nla_put_u32(skb, LFSM_ATTR_HIST_ID, i) ||
+            lfsm_nl_put_u64_array(skb, LFSM_ATTR_HIST_BUCKETS, sum->hist[i], LFSM_HIST_BUCKETS))
+            goto cancel;
+        nla_nest_end(skb, hist);
+    }
+
+    genlmsg_end(skb, msg_head);
+    cb->args[0] = 1;
+    ret = skb->len;
+    goto out;
+
+cancel:
+    genlmsg_cancel(skb, msg_head);
+out:
+    kfree(sum);
+    return ret;
+}
+
+/*
+ * SUBSCRIBE replaces the sending socket's filter with FILTER_IDS, instance
+ * ids to hear about, and FILTER_STATES, a mask of new states; either left
+ * out matches everything. UNSUBSCRIBE drops the filter.
+ */
+static int lfsm_cmd_subscribe(struct sk_buff *skb, struct genl_info *info)
+{
+    struct nlattr *ids = info->attrs[LFSM_ATTR_FILTER_IDS];
+    struct lfsm_nl_filter *f;
+    struct nlattr *attr;
+    unsigned int n = 0;
+    int rem;
+
+    if (info->genlhdr->cmd == LFSM_CMD_UNSUBSCRIBE) {
+        lfsm_nl_filter_set(info->snd_portid, NULL);
+        return 0;
+    }
+
+    if (ids) {
+        nla_for_each_nested(attr, ids, rem) {
+            if (nla_len(attr) != sizeof(u32)) {
+                NL_SET_ERR_MSG(info->extack, "FILTER_IDS entries must be u32");
+                return -EINVAL;
+            }
+            n++;
+        }
+    }
+    if (n > LFSM_FILTER_MAX_IDS)
+        return -E2BIG;
+
+    f = kzalloc(struct_size(f, ids, n), GFP_KERNEL);
+    if (!f)
+        return -ENOMEM;
+    f->portid = info->snd_portid;
+    if (info->attrs[LFSM_ATTR_FILTER_STATES])
+        f->states = nla_get_u64(info->attrs[LFSM_ATTR_FILTER_STATES]);
+    if (ids) {
+        nla_for_each_nested(attr, ids, rem)
+            f->ids[f->n_ids++] = nla_get_u32(attr);
+        sort(f->ids, f->n_ids, sizeof(u32), lfsm_u32_cmp, NULL);
+    }
+
+    lfsm_nl_filter_set(f->portid, f);
+    return 0;
+}
+
+/*
+ * A hot upgrade saves every instance with a CHECKPOINT dump before the
+ * module is unloaded and sends each message back as RESTORE once the new
+ * one is loaded. A record for an instance that exists is applied at once;
+ * others wait here until an instance of that name is created.
+ */
+struct lfsm_restore_rec {
+    struct list_head node;
+    char name[LFSM_NAME_LEN];
+    char *state_name;            /* or NULL */
+    struct lfsm_checkpoint *cp;
+};
+
+static LIST_HEAD(lfsm_restore_recs);
+static DEFINE_MUTEX(lfsm_restore_lock);
+static unsigned int lfsm_restore_n;
+
+static void lfsm_restore_free(struct lfsm_restore_rec *rec)
+{
+    kfree(rec->state_name);
+    kfree(rec->cp);
+    kfree(rec);
+}
+
+static int lfsm_restore_apply(struct lfsm_instance *inst, const struct lfsm_restore_rec *rec)
+{
+    const struct lfsm_table *table = inst->table;
+    int ret;
+
+    if (rec->state_name && (rec->cp->state >= table->n_states ||
+                            strcmp(rec->state_name, lfsm_instance_state_name(inst, rec->cp->state))))
+        ret = -EINVAL;
+    else
+        ret = lfsm_instance_restore(inst, rec->cp);
+    if (ret)
+        pr_warn("LFSM: %s: Cannot restore checkpoint: %d\n", inst->name, ret);
+    return ret;
+}
+
+/* Process context. Applies the record staged for @inst, a new instance, if any. */
+static void lfsm_restore_staged(struct lfsm_instance *inst)
+{
+    struct lfsm_restore_rec *rec, *found = NULL;
+
+    mutex_lock(&lfsm_restore_lock);
+    list_for_each_entry(rec, &lfsm_restore_recs, node) {
+        if (!strcmp(rec->name, inst->name)) {
+            list_del(&rec->node);
+            lfsm_restore_n--;
+            found = rec;
+            break;
+        }
+    }
+    mutex_unlock(&lfsm_restore_lock);
+
+    if (found) {
+        lfsm_restore_apply(inst, found);
+        lfsm_restore_free(found);
+    }
+}
+
+/* Caller holds lfsm_restore_lock. Replaces any record staged under @rec's name. */
+static int lfsm_restore_stage(struct lfsm_restore_rec *rec)
+{
+    struct lfsm_restore_rec *old;
+
+    lockdep_assert_held(&lfsm_restore_lock);
+    list_for_each_entry(old, &lfsm_restore_recs, node) {
+        if (!strcmp(old->name, rec->name)) {
+            list_replace(&old->node, &rec->node);
+            lfsm_restore_free(old);
+            return 0;
+        }
+    }
+    if (lfsm_restore_n >= LFSM_BATCH_MAX)
+        return -ENOSPC;
+    list_add_tail(&rec->node, &lfsm_restore_recs);
+    lfsm_restore_n++;
+    return 0;
+}
+
+static void lfsm_restore_free_all(void)
+{
+    struct lfsm_restore_rec *rec, *tmp;
+
+    mutex_lock(&lfsm_restore_lock);
+    list_for_each_entry_safe(rec, tmp, &lfsm_restore_recs, node) {
+        list_del(&rec->node);
+        lfsm_restore_free(rec);
+    }
+    lfsm_restore_n = 0;
+    mutex_unlock(&lfsm_restore_lock);
+}
+
+static int lfsm_nl_fill_checkpoint(struct sk_buff *skb, struct lfsm_instance *inst,
+                                   u32 portid, u32 seq, int flags)
+{
+    struct lfsm_checkpoint *cp;
+    struct nlattr *actions;
+    void *msg_head;
+    unsigned int i;
+    int ret = -EMSGSIZE;
+
+    cp = lfsm_instance_checkpoint(inst);
+    if (IS_ERR(cp))
+        return PTR_ERR(cp);
+
+    msg_head = genlmsg_put(skb, portid, seq, &lfsm_genl_family, flags, LFSM_CMD_CHECKPOINT);
+    if (!msg_head)
+        goto out;
+
+    if (nla_put_string(skb, LFSM_ATTR_NAME, inst->name) ||
+        nla_put_u32(skb, LFSM_ATTR_LINK_STATE, cp->state) ||
+        nla_put_string(skb, LFSM_ATTR_STATE_NAME, lfsm_instance_state_name(inst, cp->state)) ||
+        nla_put_u32(skb, LFSM_ATTR_DELAY_MS, cp->delay_ms) ||
+        nla_put_u32(skb, LFSM_ATTR_TIMEOUT_MS, cp->timeout_ms) ||
+        nla_put_u32(skb, LFSM_ATTR_QUEUE_DEPTH, cp->queue_depth) ||
+        nla_put_u8(skb, LFSM_ATTR_COALESCE, cp->coalesce) ||
+        nla_put_u32(skb, LFSM_ATTR_OVERFLOW_POLICY, cp->overflow_policy) ||
+        nla_put_u32(skb, LFSM_ATTR_N_URGENT, cp->n_urgent))
+        goto cancel;
+
+    actions = nla_nest_start(skb, LFSM_ATTR_ACTIONS);
+    if (!actions)
+        goto cancel;
+    for (i = 0; i < cp->n_actions; i++) {
+        if (nla_put_u32(skb, i + 1, cp->actions[i]))
+            goto cancel;
+    }
+    nla_nest_end(skb, actions);
+
+    genlmsg_end(skb, msg_head);
+    ret = 0;
+    goto out;
+
+cancel:
+    genlmsg_cancel(skb, msg_head);
+out:
+    kfree(cp);
+    return ret;
+}
+
+/* CHECKPOINT dump: one message per instance, resumed as lfsm_cmd_dump() */
+static int lfsm_cmd_dump_checkpoint(struct sk_buff *skb, struct netlink_callback *cb)
+{
+    struct lfsm_instance *inst;
+    long idx = 0, start = cb->args[0];
+    int ret = 0;
+
+    mutex_lock(&lfsm_instances_lock);
+    list_for_each_entry(inst, &lfsm_instances, node) {
+        if (idx < start) {
+            idx++;
+            continue;
+        }
+        ret = lfsm_nl_fill_checkpoint(skb, inst, NETLINK_CB(cb->skb).portid,
+                                      cb->nlh->nlmsg_seq, NLM_F_MULTI);
+        if (ret)
+            break;
+        idx++;
+    }
+    mutex_unlock(&lfsm_instances_lock);
+
+    cb->args[0] = idx;
+    /* A full skb ends this part of the dump; other errors end all of it */
+    if (ret && ret != -EMSGSIZE)
+        return ret;
+    return skb->len;
+}
+
+/*
+ * RESTORE takes the attributes of one CHECKPOINT message. STATE_NAME, if
+ * given, must name LINK_STATE in the instance's table, and ACTIONS and
+ * N_URGENT may be left out.
+ */
+static int lfsm_cmd_restore(struct sk_buff *skb, struct genl_info *info)
+{
+    static const int required[] = {
+        LFSM_ATTR_NAME, LFSM_ATTR_LINK_STATE, LFSM_ATTR_DELAY_MS, LFSM_ATTR_TIMEOUT_MS,
+        LFSM_ATTR_QUEUE_DEPTH, LFSM_ATTR_COALESCE, LFSM_ATTR_OVERFLOW_POLICY,
+    };
+    struct nlattr *actions = info->attrs[LFSM_ATTR_ACTIONS];
+    struct lfsm_instance *inst = NULL, *it;
+    struct lfsm_restore_rec *rec;
+    struct lfsm_checkpoint *cp;
+    struct nlattr *attr;
+    unsigned int i, n = 0;
+    int rem, ret;
+
+    for (i = 0; i < ARRAY_SIZE(required); i++) {
+        if (!info->attrs[required[i]]) {
+            NL_SET_ERR_MSG(info->extack, "RESTORE needs the attributes of a CHECKPOINT");
+            return -EINVAL;
+        }
+    }
+    if (actions) {
+        nla_for_each_nested(attr, actions, rem) {
+            if (nla_len(attr) != sizeof(u32)) {
+                NL_SET_ERR_MSG(info->extack, "ACTIONS entries must be u32");
+                return -EINVAL;
+            }
+            n++;
+        }
+    }
+    if (n > LFSM_PRIO_LEN + LFSM_QUEUE_MAX)
+        return -E2BIG;
+
+    rec = kzalloc(sizeof(*rec), GFP_KERNEL);
+    cp = kzalloc(struct_size(cp, actions, n), GFP_KERNEL);
+    if (!rec || !cp) {
+        kfree(cp);
+        kfree(rec);
+        return -ENOMEM;
+    }
+    rec->cp = cp;
+    nla_strscpy(rec->name, info->attrs[LFSM_ATTR_NAME], sizeof(rec->name));
+    if (info->attrs[LFSM_ATTR_STATE_NAME]) {
+        rec->state_name = nla_strdup(info->attrs[LFSM_ATTR_STATE_NAME], GFP_KERNEL);
+        if (!rec->state_name) {
+            lfsm_restore_free(rec);
+            return -ENOMEM;
+        }
+    }
+    cp->state = nla_get_u32(info->attrs[LFSM_ATTR_LINK_STATE]);
+    cp->delay_ms = nla_get_u32(info->attrs[LFSM_ATTR_DELAY_MS]);
+    cp->timeout_ms = nla_get_u32(info->attrs[LFSM_ATTR_TIMEOUT_MS]);
+    cp->queue_depth = nla_get_u32(info->attrs[LFSM_ATTR_QUEUE_DEPTH]);
+    cp->coalesce = nla_get_u8(info->attrs[LFSM_ATTR_COALESCE]);
+    cp->overflow_policy = nla_get_u32(info->attrs[LFSM_ATTR_OVERFLOW_POLICY]);
+    if (actions) {
+        nla_for_each_nested(attr, actions, rem)
+            cp->actions[cp->n_actions++] = nla_get_u32(attr);
+    }
+    if (info->attrs[LFSM_ATTR_N_URGENT])
+        cp->n_urgent = nla_get_u32(info->attrs[LFSM_ATTR_N_URGENT]);
+
+    /* Instances are only created under lfsm_instances_lock, so none can slip by */
+    mutex_lock(&lfsm_instances_lock);
+    list_for_each_entry(it, &lfsm_instances, node) {
+        if (!strcmp(it->name, rec->name)) {
+            inst = it;
+            break;
+        }
+    }
+    if (!inst) {
+        mutex_lock(&lfsm_restore_lock);
+        ret = lfsm_restore_stage(rec);
+        mutex_unlock(&lfsm_restore_lock);
+        mutex_unlock(&lfsm_instances_lock);
+        if (ret)
+            lfsm_restore_free(rec);
+        return ret;
+    }
+
+    ret = lfsm_restore_apply(inst, rec);
+    mutex_unlock(&lfsm_instances_lock);
+    lfsm_restore_free(rec);
+    return ret;
+}
+
+static const struct genl_ops lfsm_genl_ops[] = {
+    {
+        .cmd = LFSM_CMD_LINK_UP,
+        .doit = lfsm_cmd_handler,
+        .policy = lfsm_nl_policy,
+        .flags = GENL_ADMIN_PERM,
+    },
+    {
+        .cmd = LFSM_CMD_LINK_DOWN,
+        .doit = lfsm_cmd_handler,
+        .policy = lfsm_nl_policy,
+        .flags = GENL_ADMIN_PERM,
+    },
+    {
+        .cmd = LFSM_CMD_CANCEL,
+        .doit = lfsm_cmd_handler,
+        .policy = lfsm_nl_policy,
+        .flags = GENL_ADMIN_PERM,
+    },
+    {
+        .cmd = LFSM_CMD_SET_CONFIG,
+        .doit = lfsm_cmd_handler,
+        .policy = lfsm_nl_policy,
+        .flags = GENL_ADMIN_PERM,
+    },
+    {
+        .cmd = LFSM_CMD_LINK_SET_BATCH,
+        .doit = lfsm_cmd_set_batch,
+        .policy = lfsm_nl_policy,
+        .flags = GENL_ADMIN_PERM,
+    },
+    {
+        .cmd = LFSM_CMD_GET_STATS,
+        .dumpit = lfsm_cmd_dump_stats,
+        .policy = lfsm_nl_policy,
+    },
+    {
+        .cmd = LFSM_CMD_GET,
+        .doit = lfsm_cmd_get,
+        .dumpit = lfsm_cmd_dump,
+        .policy = lfsm_nl_policy,
+    },
+    {
+        .cmd = LFSM_CMD_SUBSCRIBE,
+        .doit = lfsm_cmd_subscribe,
+        .policy = lfsm_nl_policy,
+    },
+    {
+        .cmd = LFSM_CMD_UNSUBSCRIBE,
+        .doit = lfsm_cmd_subscribe,
+        .policy = lfsm_nl_policy,
+    },
+    {
+        .cmd = LFSM_CMD_CHECKPOINT,
+        .dumpit = lfsm_cmd_dump_checkpoint,
+        .policy = lfsm_nl_policy,
+        .flags = GENL_ADMIN_PERM,
+    },
+    {
+        .cmd = LFSM_CMD_RESTORE,
+        .doit = lfsm_cmd_restore,
+        .policy = lfsm_nl_policy,
+        .flags = GENL_ADMIN_PERM,
+    }
+};
+
+static struct genl_family lfsm_genl_family = {
+    .name = "lfsm_notify",
+    .version = 1,
+    .maxattr = LFSM_ATTR_MAX,
+    .module = THIS_MODULE,
+    .ops = lfsm_genl_ops,
+    .n_ops = ARRAY_SIZE(lfsm_genl_ops),
+    .mcgrps = lfsm_mcgrps,
+    .n_mcgrps = ARRAY_SIZE(lfsm_mcgrps),
+};
+
+/* Caller holds inst->lock. Appends @ev to the history ring. */
+static void lfsm_history_add(struct lfsm_instance *inst, const struct lfsm_event *ev)
+{
+    u64 pos = inst->history_head;
+    struct lfsm_history_slot *slot = &inst->history[pos % LFSM_HISTORY_LEN];
+    bool timed = (ev->cause != LFSM_CAUSE_CANCEL && ev->cause != LFSM_CAUSE_RESTORE) ||
+                 lfsm_state_transitional(inst, ev->old_state);
+
+    WRITE_ONCE(slot->seq, slot->seq + 1);
+    smp_wmb();
+    slot->pos = pos;
+    slot->rec.seq = ev->seq;
+    slot->rec.timestamp_ns = ev->timestamp_ns;
+    slot->rec.duration_ns = timed ? ev->timestamp_ns - inst->dispatch_ns : 0;
+    slot->rec.old_state = ev->old_state;
+    slot->rec.new_state = ev->new_state;
+    slot->rec.cause = ev->cause;
+    slot->rec.reserved = 0;
+    smp_wmb();
+    WRITE_ONCE(slot->seq, slot->seq + 1);
+    smp_store_release(&inst->history_head, pos + 1);
+}
+
+/*
+ * Lockless. Copies the up to LFSM_HISTORY_LEN most recent transitions of
+ * @inst into @out, oldest first, and returns how many. Slots overwritten
+ * while being read are left out. *@total is set to the number recorded
+ * since creation.
+ */
+static unsigned int lfsm_history_snapshot(struct lfsm_instance *inst,
+                                          struct lfsm_history_record *out, u64 *total)
+{
+    u64 head = smp_load_acquire(&inst->history_head);
+    u64 pos = head > LFSM_HISTORY_LEN ? head - LFSM_HISTORY_LEN : 0;
+    unsigned int n = 0;
+
+    for (; pos < head; pos++) {
+        const struct lfsm_history_slot *slot = &inst->history[pos % LFSM_HISTORY_LEN];
+        bool valid;
+        u32 seq;
+
+        do {
+            seq = READ_ONCE(slot->seq);
+            smp_rmb();
+            out[n] = slot->rec;
+            valid = slot->pos == pos;
+            smp_rmb();
+        } while ((seq & 1) || seq != READ_ONCE(slot->seq));
+
+        if (valid)
+            n++;
+    }
+    *total = head;
+    return n;
+}
+
+/*
+ * Caller holds inst->lock and has just moved the instance from @old to
+ * @new. Stamps the event, gives it the next sequence number and records it
+ * in the history ring.
+ */
+static void lfsm_event_init(struct lfsm_instance *inst, struct lfsm_event *ev,
+                            enum link_state old, enum link_state new,
+                            enum lfsm_cause cause)
+{
+    lockdep_assert_held(&inst->lock);
+    ev->inst = inst;
+    ev->old_state = old;
+    ev->new_state = new;
+    ev->cause = cause;
+    ev->timestamp_ns = ktime_get_ns();
+    ev->seq = ++inst->event_seq;
+    lfsm_history_add(inst, ev);
+}
+
+/*
+ * Process context, no instance locks held. Returns true if a parallel
+ * fan-out will queue the dispatcher, see lfsm_call_blocking_subscribers().
+ */
+static bool lfsm_deliver_event(const struct lfsm_event *ev, bool kick)
+{
+    struct lfsm_instance *inst = ev->inst;
+    bool handed_off;
+    u64 start;
+
+    pr_debug_ratelimited("LFSM: %s: Link is %s (%s)\n", inst->name,
+                         lfsm_instance_state_name(inst, ev->new_state),
+                         lfsm_cause_str[ev->cause]);
+    trace_lfsm_notify_start(inst->id, inst->name, ev->new_state,
+                            lfsm_instance_state_name(inst, ev->new_state));
+    start = ktime_get_ns();
+    lfsm_notify_state(ev);
+    handed_off = lfsm_call_blocking_subscribers(ev, kick, start);
+    if (!handed_off)
+        lfsm_hist_add(LFSM_HIST_NOTIFY, ktime_get_ns() - start);
+    trace_lfsm_notify_end(inst->id, inst->name, ev->new_state,
+                          lfsm_instance_state_name(inst, ev->new_state));
+    return handed_off;
+}
+
+// --- Timeouts ---
+
+/*
+ * Transition timeouts of all instances share one hrtimer per CPU. Armed
+ * timeouts sit in the CPU's timerqueue, sorted by expiry, and the hrtimer
+ * is programmed for the earliest one. When it fires, every timeout that is
+ * due is expired in one pass, so the cost stays flat as instances are
+ * added and timeouts keep hrtimer precision. The timers are soft, so the
+ * expiry pass and the event fan-out it starts run in softirq rather than
+ * hard IRQ. A base's lock nests inside instance locks; the expiry pass
+ * drops it before taking an instance's.
+ */
+#define LFSM_TIMEOUT_SLACK_NS (100 * NSEC_PER_USEC) /* lets nearby expiries batch */
+
+struct lfsm_timeout_base {
+    spinlock_t lock;
+    struct timerqueue_head head;
+    struct hrtimer timer;
+    struct lfsm_instance *running; /* expiring now, without the base lock */
+    wait_queue_head_t wait;        /* woken when @running is cleared */
+};
+
+static DEFINE_PER_CPU(struct lfsm_timeout_base, lfsm_timeout_bases);
+
+/* Caller holds inst->lock. Returns true if the timeout was still pending. */
+static bool lfsm_timeout_disarm(struct lfsm_instance *inst)
+{
+    struct lfsm_timeout_base *base;
+    bool pending = false;
+
+    lockdep_assert_held(&inst->lock);
+    if (inst->timeout_cpu < 0)
+        return false;
+
+    base = per_cpu_ptr(&lfsm_timeout_bases, inst->timeout_cpu);
+    spin_lock(&base->lock);
+    if (timerqueue_node_queued(&inst->timeout_node)) {
+        timerqueue_del(&base->head, &inst->timeout_node);
+        pending = true;
+    }
+    spin_unlock(&base->lock);
+    inst->timeout_cpu = -1;
+    return pending;
+}
+
+/* Caller holds inst->lock. (Re)arms the timeout on this CPU's base. */
+static void lfsm_timeout_arm(struct lfsm_instance *inst, ktime_t expires)
+{
+    struct lfsm_timeout_base *base;
+
+    lfsm_timeout_disarm(inst);
+    inst->timeout_expires = expires;
+    inst->timeout_cpu = smp_processor_id();
+    inst->timeout_node.expires = expires;
+
+    base = this_cpu_ptr(&lfsm_timeout_bases);
+    spin_lock(&base->lock);
+    if (timerqueue_add(&base->head, &inst->timeout_node))
+        hrtimer_start_range_ns(&base->timer, expires, LFSM_TIMEOUT_SLACK_NS,
+                               HRTIMER_MODE_ABS_SOFT);
+    spin_unlock(&base->lock);
+}
+
+/*
+ * Process context, may sleep, no instance locks held. Disarms @inst's
+ * timeout and waits for an expiry of it that has already begun. An expiry
+ * sets @running under the base lock before dropping it, and disarming
+ * takes that lock, so a pass that dequeued @inst is seen here.
+ */
+static void lfsm_timeout_cancel_sync(struct lfsm_instance *inst)
+{
+    int cpu;
+
+    might_sleep();
+    lfsm_lock_irq(inst);
+    lfsm_timeout_disarm(inst);
+    spin_unlock_irq(&inst->lock);
+
+    for_each_possible_cpu(cpu) {
+        struct lfsm_timeout_base *base = per_cpu_ptr(&lfsm_timeout_bases, cpu);
+
+        wait_event(base->wait, READ_ONCE(base->running) != inst);
+    }
+}
+
+/*
+ * Softirq context. Times out the transition in flight: the link moves along
+ * the table's TIMEOUT cell, pending actions are dropped, and complete_work
+ * calls the driver's abort op, delivers the event and resumes the
+ * dispatcher.
+ */
+static void lfsm_timeout_expire(struct lfsm_instance *inst)
+{
+    struct lfsm_event ev;
+    enum link_state state, next;
+    unsigned long flags;
+
+    lfsm_lock_irqsave(inst, flags);
+    state = lfsm_read_state(inst);
+    /*
+     * Lost the race against lfsm_transition_complete(), or ran late for an
+     * earlier transition while the one now in flight has its own timeout
+     */
+    if (!lfsm_state_transitional(inst, state) ||
+        ktime_before(ktime_get(), inst->timeout_expires)) {
+        spin_unlock_irqrestore(&inst->lock, flags);
+        return;
+    }
+
+    next = lfsm_lookup(inst, state, LFSM_TRIG_TIMEOUT)->next;
+    pr_warn_ratelimited("LFSM: %s: Transition timed out. Forcing link %s\n", inst->name,
+                        lfsm_instance_state_name(inst, next));
+    trace_lfsm_timeout(inst->id, inst->name, state, lfsm_instance_state_name(inst, state));
+    lfsm_stat_inc(LFSM_STAT_TIMEOUTS);
+
+    cancel_delayed_work(&inst->delay_work);
+    lfsm_flush_queue(inst);
+
+    lfsm_note_abort(inst);
+    lfsm_set_state(inst, next);
+    lfsm_settle_requests(inst, next, -ETIMEDOUT);
+    lfsm_event_init(inst, &ev, state, next, LFSM_CAUSE_TIMEOUT);
+    inst->notify_event = ev;
+    lfsm_queue_work(inst, &inst->complete_work);
+    spin_unlock_irqrestore(&inst->lock, flags);
+
+    lfsm_event_settled(&ev);
+}
+
+static enum hrtimer_restart lfsm_timeout_base_fn(struct hrtimer *timer)
+{
+    struct lfsm_timeout_base *base = container_of(timer, struct lfsm_timeout_base, timer);
+    struct timerqueue_node *next;
+    struct lfsm_instance *inst;
+    unsigned long flags;
+
+    spin_lock_irqsave(&base->lock, flags);
+    while ((next = timerqueue_getnext(&base->head)) &&
+           !ktime_after(next->expires, ktime_get())) {
+        inst = container_of(next, struct lfsm_instance, timeout_node);
+        timerqueue_del(&base->head, next);
+        base->running = inst;
+        spin_unlock_irqrestore(&base->lock, flags);
+
+        lfsm_timeout_expire(inst);
+
+        spin_lock_irqsave(&base->lock, flags);
+        WRITE_ONCE(base->running, NULL);
+        /* Orders the store above against the waiter's condition check */
+        if (wq_has_sleeper(&base->wait))
+            wake_up_all(&base->wait);
+    }
+    /* Arming may have started the timer meanwhile; this reprograms it */
+    if (next)
+        hrtimer_start_range_ns(timer, next->expires, LFSM_TIMEOUT_SLACK_NS,
+                               HRTIMER_MODE_ABS_SOFT);
+    spin_unlock_irqrestore(&base->lock, flags);
+    return HRTIMER_NORESTART;
+}
+
+static void lfsm_timeout_init(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct lfsm_timeout_base *base = per_cpu_ptr(&lfsm_timeout_bases, cpu);
+
+        spin_lock_init(&base->lock);
+        timerqueue_init_head(&base->head);
+        init_waitqueue_head(&base->wait);
+        hrtimer_setup(&base->timer, lfsm_timeout_base_fn, CLOCK_MONOTONIC,
+                      HRTIMER_MODE_ABS_SOFT);
+    }
+}
+
+static void lfsm_timeout_exit(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        hrtimer_cancel(&per_cpu_ptr(&lfsm_timeout_bases, cpu)->timer);
+}
+
+// --- Transition Workers ---
+
+/*
+ * Runs after a transition has finished: tells the driver if it was cut
+ * short, tells subscribers about the new state, then lets the dispatcher
+ * pick up the next queued action.
+ */
+static void lfsm_complete_worker(struct work_struct *work)
+{
+    struct lfsm_instance *inst = container_of(work, struct lfsm_instance, complete_work);
+    struct lfsm_event ev;
+    u64 aborted;
+
+    lfsm_lock_irq(inst);
+    ev = inst->notify_event;
+    aborted = lfsm_take_abort(inst);
+    spin_unlock_irq(&inst->lock);
+
+    lfsm_call_abort(inst, aborted);
+    if (!lfsm_deliver_event(&ev, true))
+        lfsm_queue_work(inst, &inst->worker);
+}
+
+/*
+ * Ends the transition @gen with @status. A report for any other
+ * generation is for a transition that already ended and is ignored. A
+ * timer-driven caller also passes the @deadline its timer was armed for,
+ * checked under the lock: firing before it means the delay was moved,
+ * and the report is ignored.
+ */
+static void lfsm_finish_transition(struct lfsm_instance *inst, u64 gen, int status,
+                                   const unsigned long *deadline)
+{
+    enum link_state state, next;
+    enum lfsm_cause cause = LFSM_CAUSE_REQUEST;
+    struct lfsm_event ev;
+    unsigned long flags;
+
+    lfsm_lock_irqsave(inst, flags);
+    state = lfsm_read_state(inst);
+    if (!lfsm_state_transitional(inst, state) || lfsm_read_gen(inst) != gen ||
+        (deadline && time_before(jiffies, *deadline))) {
+        spin_unlock_irqrestore(&inst->lock, flags);
+        return;
+    }
+
+    lfsm_timeout_disarm(inst);
+    lfsm_stat_inc(LFSM_STAT_COMPLETED);
+    lfsm_hist_add(LFSM_HIST_DISPATCH_TO_COMPLETE, ktime_get_ns() - inst->dispatch_ns);
+    if (status) {
+        pr_warn("LFSM: %s: Transition from %s failed (%d)\n",
+                inst->name, lfsm_instance_state_name(inst, state), status);
+        cause = LFSM_CAUSE_FAILURE;
+    }
+    next = lfsm_lookup(inst, state, status ? LFSM_TRIG_FAILED : LFSM_TRIG_DONE)->next;
+
+    lfsm_set_state(inst, next);
+    lfsm_settle_requests(inst, next, status);
+    lfsm_event_init(inst, &ev, state, next, cause);
+    inst->notify_event = ev;
+    lfsm_queue_work(inst, &inst->complete_work);
+    spin_unlock_irqrestore(&inst->lock, flags);
+
+    lfsm_event_settled(&ev);
+}
+
+/**
+ * lfsm_transition_complete - Reports the outcome of a driver transition.
+ * @inst: The LFSM instance whose start_up/start_down op was called.
+ * @gen: The generation the op was called with.
+ * @status: 0 if the transition succeeded, negative error code otherwise.
+ *
+ * Moves LINK_STARTING to LINK_UP and LINK_STOPPING to LINK_DOWN on success.
+ * A failed transition leaves the link in LINK_DOWN. Instances created from
+ * their own table follow its DONE or FAILED cell instead. Reports for a
+ * transition that already timed out or was cancelled are ignored, even
+ * once a later transition is in flight.
+ *
+ * Context: Any context, including hard IRQ.
+ */
+void lfsm_transition_complete(struct lfsm_instance *inst, u64 gen, int status)
+{
+    lfsm_finish_transition(inst, gen, status, NULL);
+}
+EXPORT_SYMBOL_GPL(lfsm_transition_complete);
+
+/*
+ * Instances created without driver ops model each transition as a fixed
+ * delay_ms wait. The wait is a delayed work item rather than a
+ * sleeping kworker, and ends through the same completion path as hardware.
+ */
+static void lfsm_delay_worker(struct work_struct *work)
+{
+    struct lfsm_instance *inst = container_of(to_delayed_work(work),
+                                              struct lfsm_instance, delay_work);
+    u64 gen;
+
+    lfsm_lock_irq(inst);
+    gen = inst->delay_gen;
+    spin_unlock_irq(&inst->lock);
+    lfsm_finish_transition(inst, gen, 0, &inst->delay_expires);
+}
+
+static int lfsm_delay_start(struct lfsm_instance *inst, void *priv, u64 gen)
+{
+    unsigned long flags;
+
+    lfsm_lock_irqsave(inst, flags);
+    inst->delay_gen = gen;
+    inst->delay_expires = jiffies + msecs_to_jiffies(inst->delay_ms);
+    lfsm_queue_delayed_work(inst, &inst->delay_work, msecs_to_jiffies(inst->delay_ms));
+    spin_unlock_irqrestore(&inst->lock, flags);
+    return 0;
+}
+
+static int lfsm_delay_enter(struct lfsm_instance *inst, void *priv, unsigned int state,
+                            u64 gen)
+{
+    return lfsm_delay_start(inst, priv, gen);
+}
+
+static const struct lfsm_ops lfsm_delay_ops = {
+    .start_up = lfsm_delay_start,
+    .start_down = lfsm_delay_start,
+    .enter = lfsm_delay_enter,
+};
+
+// --- LFSM Dispatcher ---
+
+/*
+ * Caller holds inst->lock and owns the dispatcher (work_active). Takes the
+ * next action off the queue and looks up where it leads. Entering a
+ * transitional state arms the timeout; a move straight to another stable
+ * state is settled here and fills in @ev, with complete_work queued to
+ * deliver it. The priority lane is drained before the queue. Actions the
+ * current state no longer accepts are resolved from where the link now is
+ * and skipped. A queued UP/DOWN whose dependencies are not met yet stays
+ * at the head of the queue until lfsm_dep_kick(); urgent ones do not wait.
+ * Returns false, and gives up the dispatcher, if there is nothing to
+ * start; otherwise the caller must lfsm_run_transition() with @gen once
+ * unlocked.
+ */
+static bool lfsm_begin_transition(struct lfsm_instance *inst, const struct lfsm_transition **tr,
+                                  struct lfsm_event *ev, u64 *gen)
+{
+    const struct lfsm_transition *e;
+    struct lfsm_action act;
+    enum link_state state;
+    unsigned int ms;
+    bool urgent;
+
+    lockdep_assert_held(&inst->lock);
+    for (;;) {
+        urgent = kfifo_out(&inst->prio, &act, 1);
+        if (!urgent && !kfifo_peek(&inst->queue, &act)) {
+            inst->work_active = false;
+            return false;
+        }
+
+        state = lfsm_read_state(inst);
+        e = lfsm_lookup(inst, state, act.type);
+        if (!urgent) {
+            if (e->op != LFSM_OP_INVALID && lfsm_dep_wait(inst, act.type)) {
+                inst->work_active = false;
+                return false;
+            }
+            kfifo_skip(&inst->queue);
+        }
+        inst->dep_blocked = false;
+
+        trace_lfsm_dequeue(inst->id, inst->name, act.type, lfsm_trigger_name(inst, act.type),
+                           kfifo_len(&inst->queue));
+        if (e->op != LFSM_OP_INVALID)
+            break;
+
+        /* Queued behind an action that already led elsewhere */
+        pr_debug_ratelimited("LFSM: %s: %s not accepted in %s, skipped\n", inst->name,
+                             lfsm_trigger_name(inst, act.type),
+                             lfsm_instance_state_name(inst, state));
+        lfsm_request_finish(act.context, act.type < LFSM_ACT_MAX &&
+                            lfsm_state_link(inst, state) == lfsm_action_target(act.type) ?
+                            0 : -ECANCELED);
+    }
+
+    lfsm_request_wait_settle(inst, act.context);
+    inst->dispatch_ns = ktime_get_ns();
+    lfsm_hist_add(LFSM_HIST_ENQUEUE_TO_DISPATCH, inst->dispatch_ns - act.enqueue_ns);
+    lfsm_set_state(inst, e->next);
+    *tr = e;
+    *gen = lfsm_read_gen(inst);
+
+    if (!lfsm_state_transitional(inst, e->next)) {
+        lfsm_settle_requests(inst, e->next, 0);
+        lfsm_event_init(inst, ev, state, e->next, LFSM_CAUSE_REQUEST);
+        inst->notify_event = *ev;
+        lfsm_queue_work(inst, &inst->complete_work);
+        return true;
+    }
+
+    ms = e->timeout_ms ? e->timeout_ms : inst->timeout_ms;
+    inst->timeout_fixed = e->timeout_ms != 0;
+    inst->transition_start = jiffies;
+    /* Stale until lfsm_delay_start() arms the delay of this transition */
+    inst->delay_expires = inst->transition_start + msecs_to_jiffies(inst->delay_ms);
+    lfsm_timeout_arm(inst, ktime_add_ms(ns_to_ktime(inst->dispatch_ns), ms));
+    return true;
+}
+
+static bool lfsm_op_hooked(const struct lfsm_ops *ops, enum lfsm_op op)
+{
+    switch (op) {
+    case LFSM_OP_START_UP:
+        return ops->start_up;
+    case LFSM_OP_START_DOWN:
+        return ops->start_down;
+    case LFSM_OP_ENTER:
+        return ops->enter;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Process context, no instance locks held. Calls the driver op of @tr for
+ * the transition @gen, or settles @ev if it moved between stable states.
+ * The op is skipped if @gen already ended while the lock was dropped.
+ */
+static void lfsm_run_transition(struct lfsm_instance *inst, const struct lfsm_transition *tr,
+                                const struct lfsm_event *ev, u64 gen)
+{
+    const struct lfsm_ops *ops = inst->ops;
+    bool hooked, current_gen;
+    int ret = 0;
+
+    if (!lfsm_state_transitional(inst, tr->next)) {
+        lfsm_event_settled(ev);
+        return;
+    }
+
+    /* Entering a transitional state raises no event, but state_show() changed */
+    lfsm_state_notify(inst);
+
+    /* An urgent DOWN, a timeout or a reset may have ended it meanwhile */
+    hooked = lfsm_op_hooked(ops, tr->op);
+    lfsm_lock_irq(inst);
+    current_gen = lfsm_read_gen(inst) == gen;
+    if (current_gen && hooked)
+        inst->op_gen = gen; /* from here on, ending it early owes an abort */
+    spin_unlock_irq(&inst->lock);
+    if (!current_gen)
+        return;
+    if (!hooked) {
+        lfsm_transition_complete(inst, gen, 0);
+        return;
+    }
+
+    /* The op may complete synchronously, so it runs without the lock held */
+    switch (tr->op) {
+    case LFSM_OP_START_UP:
+        ret = ops->start_up(inst, inst->priv, gen);
+        break;
+    case LFSM_OP_START_DOWN:
+        ret = ops->start_down(inst, inst->priv, gen);
+        break;
+    default:
+        ret = ops->enter(inst, inst->priv, tr->next, gen);
+        break;
+    }
+
+    if (ret)
+        lfsm_transition_complete(inst, gen, ret);
+}
+
+static void lfsm_dispatch_worker(struct work_struct *work)
+{
+    struct lfsm_instance *inst = container_of(work, struct lfsm_instance, worker);
+    const struct lfsm_transition *tr;
+    struct lfsm_event ev;
+    bool began;
+    u64 gen;
+
+    lfsm_lock_irq(inst);
+    began = lfsm_begin_transition(inst, &tr, &ev, &gen);
+    spin_unlock_irq(&inst->lock);
+
+    if (began)
+        lfsm_run_transition(inst, tr, &ev, gen);
+}
+
+// --- Public Link LFSM Wrapper API ---
+
+/*
+ * Caller holds inst->lock. A full queue is handled according to the
+ * instance's overflow policy: refuse the new action, make room by dropping
+ * the oldest one, or drop everything pending so only the latest remains.
+ */
+static int enqueue_lfsm_action(struct lfsm_instance *inst, unsigned int type,
+                               struct lfsm_request *req)
+{
+    struct lfsm_action act = { .type = type, .enqueue_ns = ktime_get_ns(), .context = req };
+    struct lfsm_action old;
+
+    lockdep_assert_held(&inst->lock);
+    if (kfifo_is_full(&inst->queue)) {
+        inst->overflows++;
+        switch (inst->overflow_policy) {
+        case LFSM_OVERFLOW_DROP_OLDEST:
+            if (kfifo_get(&inst->queue, &old))
+                lfsm_request_finish(old.context, -ECANCELED);
+            break;
+        case LFSM_OVERFLOW_COLLAPSE:
+            lfsm_flush_queue(inst);
+            break;
+        default:
+            lfsm_stat_inc(LFSM_STAT_REJECTED_NOSPC);
+            return -ENOSPC;
+        }
+    }
+
+    kfifo_put(&inst->queue, act);
+    lfsm_stat_inc(LFSM_STAT_ENQUEUED);
+    inst->queue_hwm = max(inst->queue_hwm, kfifo_len(&inst->queue));
+
+    if (!inst->work_active) {
+        inst->work_active = true;
+        if (!inst->dispatch_inline)
+            lfsm_queue_work(inst, &inst->worker);
+    }
+
+    trace_lfsm_enqueue(inst->id, inst->name, type, lfsm_trigger_name(inst, type),
+                       kfifo_len(&inst->queue));
+    pr_debug_ratelimited("LFSM: %s: Queued action: %s\n", inst->name,
+                         lfsm_trigger_name(inst, type));
+    return 0;
+}
+
+/*
+ * Caller holds inst->lock. LINK_UP or LINK_DOWN, whichever the link settles
+ * in once the current transition completes.
+ */
+static enum link_state lfsm_heading(struct lfsm_instance *inst)
+{
+    enum link_state state = lfsm_read_state(inst);
+
+    if (lfsm_state_transitional(inst, state))
+        state = lfsm_lookup(inst, state, LFSM_TRIG_DONE)->next;
+    return lfsm_state_link(inst, state);
+}
+
+/*
+ * Caller holds inst->lock. With coalescing on, the queue holds at most the
+ * single action needed to reach the most recently requested state. A new
+ * request collapses into an identical pending action, cancels an opposite
+ * one, is dropped if the link is already heading there, and is queued
+ * otherwise. Unlike the strict path, requests made during a transition are
+ * accepted rather than refused with -EBUSY.
+ */
+static int lfsm_coalesce_action(struct lfsm_instance *inst, enum lfsm_action_type type,
+                                struct lfsm_request *req)
+{
+    struct lfsm_action pending;
+
+    /* The queue holds at most one action here, so it can be taken out and put back */
+    if (kfifo_peek(&inst->queue, &pending) && pending.type >= LFSM_ACT_MAX) {
+        /* A custom trigger says nothing about UP/DOWN; the new request replaces it */
+        lfsm_flush_queue(inst);
+        inst->elided++;
+    }
+    if (kfifo_get(&inst->queue, &pending)) {
+        if (pending.type == type) {
+            inst->elided++;
+            if (req) {
+                req->next = pending.context;
+                pending.context = req;
+            }
+            kfifo_put(&inst->queue, pending);
+        } else {
+            lfsm_request_finish(pending.context, -ECANCELED);
+            inst->elided += 2;
+            lfsm_request_elide(inst, req);
+        }
+        return 0;
+    }
+
+    if (lfsm_heading(inst) == lfsm_action_target(type)) {
+        inst->elided++;
+        lfsm_request_elide(inst, req);
+        return 0;
+    }
+
+    return enqueue_lfsm_action(inst, type, req);
+}
+
+/* Caller holds inst->lock. Reduces a queue built without coalescing to its net effect. */
+static void lfsm_compact_queue(struct lfsm_instance *inst)
+{
+    unsigned int n = kfifo_len(&inst->queue);
+    struct lfsm_action act, last = {};
+
+    if (n <= 1)
+        return;
+
+    /* Requests of the superseded actions are cancelled */
+    while (kfifo_get(&inst->queue, &act)) {
+        lfsm_request_finish(last.context, -ECANCELED);
+        last = act;
+    }
+    inst->elided += n - 1;
+
+    if (last.type < LFSM_ACT_MAX && lfsm_heading(inst) == lfsm_action_target(last.type)) {
+        inst->elided++;
+        lfsm_request_elide(inst, last.context);
+    } else {
+        kfifo_put(&inst->queue, last);
+    }
+}
+
+/*
+ * Caller holds inst->lock. A custom trigger is queued from a stable state
+ * whose row accepts it. Under coalescing it replaces whatever is pending,
+ * keeping the queue at a single action, and is taken during a transition.
+ */
+static int lfsm_trigger_action(struct lfsm_instance *inst, unsigned int trigger)
+{
+    enum link_state state = lfsm_read_state(inst);
+    unsigned int n;
+
+    if (lfsm_state_transitional(inst, state)) {
+        if (!inst->coalesce) {
+            lfsm_stat_inc(LFSM_STAT_REJECTED_BUSY);
+            return -EBUSY;
+        }
+    } else if (lfsm_lookup(inst, state, trigger)->op == LFSM_OP_INVALID) {
+        return -EINVAL;
+    }
+
+    if (inst->coalesce) {
+        n = kfifo_len(&inst->queue);
+        lfsm_flush_queue(inst);
+        inst->elided += n;
+    }
+    return enqueue_lfsm_action(inst, trigger, NULL);
+}
+
+/*
+ * Caller holds inst->lock. Gate for UP/DOWN requests: without coalescing an
+ * action is only queued from a stable state whose table row accepts it.
+ * A stable state that does not, but already counts as the requested
+ * UP/DOWN, satisfies the request.
+ */
+static int lfsm_submit_action(struct lfsm_instance *inst, unsigned int type,
+                              struct lfsm_request *req)
+{
+    enum link_state state = lfsm_read_state(inst);
+
+    if (inst->coalesce)
+        return lfsm_coalesce_action(inst, type, req);
+    if (lfsm_state_transitional(inst, state)) {
+        lfsm_stat_inc(LFSM_STAT_REJECTED_BUSY);
+        return -EBUSY;
+    }
+    if (lfsm_lookup(inst, state, type)->op != LFSM_OP_INVALID)
+        return enqueue_lfsm_action(inst, type, req);
+    if (lfsm_state_link(inst, state) == lfsm_action_target(type)) {
+        lfsm_request_finish(req, 0);
+        return 0;
+    }
+    return -EINVAL;
+}
+
+/*
+ * Timer context. Queues the request held by lfsm_hold_action(); one the gate
+ * refuses is finished with its error, as its caller was told it succeeded.
+ */
+static enum hrtimer_restart lfsm_hold_timer_fn(struct hrtimer *timer)
+{
+    struct lfsm_instance *inst = container_of(timer, struct lfsm_instance, hold_timer);
+    struct lfsm_request *req;
+    unsigned long flags;
+    unsigned int type;
+    int ret;
+
+    lfsm_lock_irqsave(inst, flags);
+    type = inst->held_type;
+    req = inst->held_req;
+    /* Nothing left, or re-armed for a later release while this run waited */
+    if (type == LFSM_ACT_MAX || ktime_before(ktime_get(), inst->held_until)) {
+        spin_unlock_irqrestore(&inst->lock, flags);
+        return HRTIMER_NORESTART;
+    }
+
+    inst->held_type = LFSM_ACT_MAX;
+    inst->held_req = NULL;
+    ret = lfsm_submit_action(inst, type, req);
+    if (ret) {
+        pr_debug_ratelimited("LFSM: %s: Held %s refused (%d)\n", inst->name,
+                             lfsm_trigger_name(inst, type), ret);
+        lfsm_request_finish(req, ret);
+    }
+    spin_unlock_irqrestore(&inst->lock, flags);
+    return HRTIMER_NORESTART;
+}
+
+/* Caller holds inst->lock. Counts an UP that followed a DOWN. */
+static void lfsm_count_flap(struct lfsm_instance *inst, ktime_t now)
+{
+    if (ktime_ms_delta(now, inst->last_flap) > inst->holddown_max_ms) {
+        inst->flaps = 0;
+        inst->holddown_cur_ms = inst->holddown_ms;
+    }
+    inst->last_flap = now;
+    if (++inst->flaps < inst->holddown_flaps)
+        return;
+
+    inst->flaps = 0;
+    inst->holddowns++;
+    inst->holddown_until = ktime_add_ms(now, inst->holddown_cur_ms);
+    pr_info_ratelimited("LFSM: %s: Link flapping, holding it down for %u ms\n",
+                        inst->name, inst->holddown_cur_ms);
+    inst->holddown_cur_ms = min_t(u64, (u64)inst->holddown_cur_ms * 2, inst->holddown_max_ms);
+}
+
+/*
+ * Caller holds inst->lock. Debounce and flap hold-down of UP/DOWN requests.
+ * With debounce_ms set a request is held for that long, and a different
+ * one arriving meanwhile replaces it and restarts the window, so a carrier
+ * bounce queues at most the state it ended in. Every UP following a DOWN
+ * is a flap: holddown_flaps of them, each within holddown_max_ms of the
+ * last, hold UP requests back for holddown_ms, doubling with each further
+ * hold-down up to holddown_max_ms. A quiet holddown_max_ms forgives the
+ * flaps. hold_timer submits what is held once it is due. Returns true if
+ * it took @req.
+ */
+static bool lfsm_hold_action(struct lfsm_instance *inst, unsigned int type,
+                             struct lfsm_request *req)
+{
+    ktime_t now, release;
+
+    if (!inst->debounce_ms && !inst->holddown_flaps && inst->held_type == LFSM_ACT_MAX)
+        return false;
+
+    now = ktime_get();
+    if (inst->holddown_flaps && type == LFSM_ACT_LINK_UP &&
+        inst->last_req_type == LFSM_ACT_LINK_DOWN)
+        lfsm_count_flap(inst, now);
+    inst->last_req_type = type;
+
+    release = ktime_add_ms(now, inst->debounce_ms);
+    if (type == LFSM_ACT_LINK_UP && ktime_before(release, inst->holddown_until))
+        release = inst->holddown_until;
+
+    if (inst->held_type == type) {
+        /* A repeat joins the held request without restarting its window */
+        if (req) {
+            req->next = inst->held_req;
+            inst->held_req = req;
+        }
+        if (type == LFSM_ACT_LINK_UP && ktime_before(inst->held_until, inst->holddown_until)) {
+            inst->held_until = inst->holddown_until;
+            hrtimer_start(&inst->hold_timer, inst->held_until, HRTIMER_MODE_ABS);
+        }
+        return true;
+    }
+
+    if (inst->held_type != LFSM_ACT_MAX) {
+        lfsm_request_finish(inst->held_req, -ECANCELED);
+        inst->held_type = LFSM_ACT_MAX;
+        inst->held_req = NULL;
+        inst->debounced++;
+    }
+    if (!ktime_after(release, now))
+        return false;
+
+    inst->held_type = type;
+    inst->held_req = req;
+    inst->held_until = release;
+    hrtimer_start(&inst->hold_timer, release, HRTIMER_MODE_ABS);
+    return true;
+}
+
+/* Caller holds inst->lock. Common entry of every request. */
+static int lfsm_request_action(struct lfsm_instance *inst, unsigned int type,
+                               struct lfsm_request *req)
+{
+    lockdep_assert_held(&inst->lock);
+    if (unlikely(inst->dead))
+        return -ENODEV;
+    if (type >= LFSM_ACT_MAX)
+        return lfsm_trigger_action(inst, type);
+    if (lfsm_hold_action(inst, type, req))
+        return 0;
+    return lfsm_submit_action(inst, type, req);
+}
+
+/*
+ * Entry point of every link_up/link_down/trigger request. @may_sleep is the
+ * caller's promise that it runs in process context with no locks held:
+ * only then, with direct_dispatch on, does a caller that finds the
+ * dispatcher idle start the transition itself instead of queueing the
+ * worker, saving a workqueue round trip.
+ */
+static int lfsm_request(struct lfsm_instance *inst, unsigned int type,
+                        struct lfsm_request *req, bool may_sleep)
+{
+    bool direct = may_sleep && READ_ONCE(inst->direct_dispatch);
+    const struct lfsm_transition *tr;
+    struct lfsm_event ev;
+    unsigned long flags;
+    bool was_active, began = false;
+    int ret;
+    u64 gen;
+
+    if (may_sleep)
+        might_sleep();
+    lfsm_lock_irqsave(inst, flags);
+    was_active = inst->work_active;
+    inst->dispatch_inline = direct;
+    ret = lfsm_request_action(inst, type, req);
+    inst->dispatch_inline = false;
+    if (direct && !was_active && inst->work_active)
+        began = lfsm_begin_transition(inst, &tr, &ev, &gen);
+    spin_unlock_irqrestore(&inst->lock, flags);
+
+    if (began) {
+        lfsm_stat_inc(LFSM_STAT_DIRECT_DISPATCHES);
+        lfsm_run_transition(inst, tr, &ev, gen);
+    }
+    return ret;
+}
+
+/**
+ * lfsm_instance_link_up - Requests that an instance's link be brought up.
+ * @inst: The LFSM instance to act on.
+ *
+ * Queues a LINK_UP action if the link is currently down. The transition
+ * itself happens asynchronously on the LFSM workqueue. With coalescing
+ * enabled the request is merged with pending actions instead, see
+ * lfsm_instance_set_coalesce(). A debounce window or flap hold-down holds
+ * the request back first, see lfsm_instance_set_debounce_ms().
+ *
+ * Return: 0 on success, when held, or if the link is already up, -EBUSY if a
+ * transition is in progress, -ENOSPC if the action queue is full and the
+ * overflow policy is LFSM_OVERFLOW_REJECT, -EINVAL if the instance's table
+ * accepts no LINK_UP in its current state, -ENODEV once the instance is
+ * being destroyed.
+ */
+int lfsm_instance_link_up(struct lfsm_instance *inst)
+{
+    return lfsm_request(inst, LFSM_ACT_LINK_UP, NULL, false);
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_link_up);
+
+/**
+ * lfsm_instance_link_up_sync - As lfsm_instance_link_up(), from a sleepable caller.
+ * @inst: The LFSM instance to act on.
+ *
+ * With direct_dispatch enabled and the dispatcher idle, the transition is
+ * begun and the driver op called before this returns, in the caller's
+ * context; otherwise it behaves exactly like lfsm_instance_link_up(). It
+ * does not wait for the transition to finish, see
+ * lfsm_instance_link_up_wait() for that.
+ *
+ * Context: Process context, may sleep. No locks the driver ops take.
+ * Return: As lfsm_instance_link_up().
+ */
+int lfsm_instance_link_up_sync(struct lfsm_instance *inst)
+{
+    return lfsm_request(inst, LFSM_ACT_LINK_UP, NULL, true);
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_link_up_sync);
+
+/**
+ * lfsm_instance_link_down - Requests that an instance's link be taken down.
+ * @inst: The LFSM instance to act on.
+ *
+ * Queues a LINK_DOWN action if the link is currently up. The transition
+ * itself happens asynchronously on the LFSM workqueue. With coalescing
+ * enabled the request is merged with pending actions instead, see
+ * lfsm_instance_set_coalesce(). A debounce window or flap hold-down holds
+ * the request back first, see lfsm_instance_set_debounce_ms().
+ *
+ * Return: 0 on success, when held, or if the link is already down, -EBUSY if a
+ * transition is in progress, -ENOSPC if the action queue is full and the
+ * overflow policy is LFSM_OVERFLOW_REJECT, -EINVAL if the instance's table
+ * accepts no LINK_DOWN in its current state, -ENODEV once the instance is
+ * being destroyed.
+ */
+int lfsm_instance_link_down(struct lfsm_instance *inst)
+{
+    return lfsm_request(inst, LFSM_ACT_LINK_DOWN, NULL, false);
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_link_down);
+
+/**
+ * lfsm_instance_link_down_sync - As lfsm_instance_link_down(), from a sleepable caller.
+ * @inst: The LFSM instance to act on.
+ *
+ * See lfsm_instance_link_up_sync().
+ *
+ * Context: Process context, may sleep. No locks the driver ops take.
+ * Return: As lfsm_instance_link_down().
+ */
+int lfsm_instance_link_down_sync(struct lfsm_instance *inst)
+{
+    return lfsm_request(inst, LFSM_ACT_LINK_DOWN, NULL, true);
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_link_down_sync);
+
+/**
+ * lfsm_instance_trigger - Raises a custom trigger of an instance's table.
+ * @inst: The LFSM instance to act on.
+ * @trigger: A trigger of the instance's table, from LFSM_TRIG_CUSTOM on.
+ *
+ * Queues @trigger if the current state's row of the table accepts it; it is
+ * dispatched like a link_up/link_down action, entering the cell's next state
+ * and running its op. With coalescing enabled the trigger replaces whatever
+ * is pending and is also taken during a transition, in which case it is
+ * skipped if the state reached then does not accept it.
+ *
+ * Context: Any context.
+ * Return: 0 on success, -EINVAL if @trigger is not a custom trigger of the
+ * table or not accepted in the current state, -EBUSY if a transition is in
+ * progress, -ENOSPC as lfsm_instance_link_up().
+ */
+int lfsm_instance_trigger(struct lfsm_instance *inst, unsigned int trigger)
+{
+    if (trigger < LFSM_TRIG_CUSTOM || trigger >= inst->table->n_triggers)
+        return -EINVAL;
+    return lfsm_request(inst, trigger, NULL, false);
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_trigger);
+
+/*
+ * Caller holds inst->lock. Ends the transition in flight from @state at
+ * @next straight away, as if the driver had failed it, and fills in @ev.
+ * complete_work calls the driver's abort op if its start op already ran;
+ * a late lfsm_transition_complete() for the aborted transition is ignored,
+ * as after a timeout.
+ */
+static void lfsm_abort_transition(struct lfsm_instance *inst, enum link_state state,
+                                  enum link_state next, struct lfsm_event *ev)
+{
+    lockdep_assert_held(&inst->lock);
+    lfsm_timeout_disarm(inst);
+    cancel_delayed_work(&inst->delay_work);
+    lfsm_stat_inc(LFSM_STAT_PREEMPTED);
+    pr_info_ratelimited("LFSM: %s: Transition from %s aborted by urgent request\n",
+                        inst->name, lfsm_instance_state_name(inst, state));
+
+    lfsm_note_abort(inst);
+    lfsm_set_state(inst, next);
+    lfsm_settle_requests(inst, next, -ECANCELED);
+    lfsm_event_init(inst, ev, state, next, LFSM_CAUSE_PREEMPT);
+    inst->notify_event = *ev;
+    lfsm_queue_work(inst, &inst->complete_work);
+}
+
+/*
+ * Puts @type on the priority lane, which the dispatcher drains before the
+ * ordinary queue, bypassing debounce, hold-down and coalescing. A
+ * transition in flight that heads away from @type is aborted when its
+ * failure exit already lands there, so an emergency DOWN never waits for a
+ * STARTING link. A full lane drops its oldest action.
+ */
+static int lfsm_request_urgent(struct lfsm_instance *inst, unsigned int type)
+{
+    struct lfsm_action act = { .type = type, .enqueue_ns = ktime_get_ns() };
+    enum link_state state, target = lfsm_action_target(type);
+    bool aborted = false;
+    struct lfsm_event ev;
+    unsigned long flags;
+    int ret = 0;
+
+    lfsm_lock_irqsave(inst, flags);
+    if (unlikely(inst->dead)) {
+        ret = -ENODEV;
+        goto unlock;
+    }
+
+    state = lfsm_read_state(inst);
+    if (kfifo_is_empty(&inst->prio)) {
+        if (lfsm_heading(inst) == target)
+            goto unlock;
+        if (lfsm_state_transitional(inst, state)) {
+            enum link_state next = lfsm_lookup(inst, state, LFSM_TRIG_FAILED)->next;
+
+            if (lfsm_state_link(inst, next) == target) {
+                lfsm_abort_transition(inst, state, next, &ev);
+                aborted = true;
+                goto unlock;
+            }
+        }
+    }
+
+    if (kfifo_is_full(&inst->prio)) {
+        inst->overflows++;
+        kfifo_skip(&inst->prio);
+    }
+    kfifo_put(&inst->prio, act);
+    lfsm_stat_inc(LFSM_STAT_ENQUEUED);
+    trace_lfsm_enqueue(inst->id, inst->name, type, lfsm_trigger_name(inst, type),
+                       kfifo_len(&inst->prio));
+    if (!inst->work_active) {
+        inst->work_active = true;
+        lfsm_queue_work(inst, &inst->worker);
+    }
+unlock:
+    spin_unlock_irqrestore(&inst->lock, flags);
+
+    if (aborted)
+        lfsm_event_settled(&ev);
+    return ret;
+}
+
+/**
+ * lfsm_instance_link_down_urgent - Takes a link down ahead of queued work.
+ * @inst: The LFSM instance to act on.
+ *
+ * For fault isolation: the LINK_DOWN goes on the instance's priority lane,
+ * which the dispatcher serves before any ordinary queued action, and is
+ * neither debounced nor refused because a transition is in progress or the
+ * queue is full. A LINK_STARTING transition is aborted on the spot, leaving
+ * the link down with an LFSM_CAUSE_PREEMPT event; a LINK_STOPPING one is
+ * left to finish. Unlike lfsm_instance_force_down() nothing is cancelled or
+ * waited for, and ordinary actions queued earlier still run afterwards.
+ *
+ * Context: Any context.
+ * Return: 0 on success or if the link is already down or going down,
+ * -ENODEV once the instance is being destroyed.
+ */
+int lfsm_instance_link_down_urgent(struct lfsm_instance *inst)
+{
+    return lfsm_request_urgent(inst, LFSM_ACT_LINK_DOWN);
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_link_down_urgent);
+
+/**
+ * lfsm_instance_link_up_urgent - Brings a link up ahead of queued work.
+ * @inst: The LFSM instance to act on.
+ *
+ * As lfsm_instance_link_down_urgent(), for an administrative override
+ * that brings the link up. A LINK_STOPPING transition is left to finish,
+ * as its failure exit is LINK_DOWN too; the LINK_UP runs right after it.
+ *
+ * Context: Any context.
+ * Return: 0 on success or if the link is already up or going up,
+ * -ENODEV once the instance is being destroyed.
+ */
+int lfsm_instance_link_up_urgent(struct lfsm_instance *inst)
+{
+    return lfsm_request_urgent(inst, LFSM_ACT_LINK_UP);
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_link_up_urgent);
+
+/*
+ * Asks every child of @inst that sits idle in an UP state to go down, for
+ * a LINK_DOWN of @inst waiting on them or after @inst fell down. Busy
+ * children are left alone; settling kicks @inst to look again.
+ */
+static void lfsm_dep_worker(struct work_struct *work)
+{
+    struct lfsm_instance *inst = container_of(work, struct lfsm_instance, dep_work);
+    struct lfsm_instance *child;
+    struct lfsm_dep *dep;
+
+    mutex_lock(&lfsm_deps_lock);
+    list_for_each_entry(dep, &inst->dep_children, child_entry) {
+        child = dep->child;
+        lfsm_lock_irq(child);
+        if (lfsm_dep_is(child, LINK_UP) && !child->work_active &&
+            kfifo_is_empty(&child->queue))
+            lfsm_request_action(child, LFSM_ACT_LINK_DOWN, NULL);
+        spin_unlock_irq(&child->lock);
+    }
+    mutex_unlock(&lfsm_deps_lock);
+}
+
+static u64 lfsm_dep_epoch; /* stamps one lfsm_dep_reaches() walk */
+
+/*
+ * Caller holds lfsm_deps_lock. An instance is walked once per epoch; a
+ * later path into it only checks that its longest chain of ancestors,
+ * remembered in dep_height, still fits under the depth limit.
+ */
+static int lfsm_dep_walk(struct lfsm_instance *from, struct lfsm_instance *to,
+                         unsigned int depth)
+{
+    unsigned int height = 0;
+    struct lfsm_dep *dep;
+    int ret;
+
+    if (from == to)
+        return 1;
+    if (from->dep_epoch == lfsm_dep_epoch)
+        return depth + from->dep_height >= LFSM_DEP_MAX_DEPTH ? -EMLINK : 0;
+    if (depth >= LFSM_DEP_MAX_DEPTH)
+        return -EMLINK;
+    list_for_each_entry(dep, &from->dep_parents, parent_entry) {
+        ret = lfsm_dep_walk(dep->parent, to, depth + 1);
+        if (ret)
+            return ret;
+        height = max(height, dep->parent->dep_height + 1);
+    }
+    from->dep_epoch = lfsm_dep_epoch;
+    from->dep_height = height;
+    return 0;
+}
+
+/* Caller holds lfsm_deps_lock. Is @to among @from's ancestors? */
+static int lfsm_dep_reaches(struct lfsm_instance *from, struct lfsm_instance *to)
+{
+    lockdep_assert_held(&lfsm_deps_lock);
+    lfsm_dep_epoch++;
+    return lfsm_dep_walk(from, to, 0);
+}
+
+/* Caller holds lfsm_deps_lock */
+static struct lfsm_dep *lfsm_dep_find(struct lfsm_instance *child, struct lfsm_instance *parent)
+{
+    struct lfsm_dep *dep;
+
+    list_for_each_entry(dep, &child->dep_parents, parent_entry) {
+        if (dep->parent == parent)
+            return dep;
+    }
+    return NULL;
+}
+
+/* Caller holds lfsm_deps_lock. Unlinks @dep and lets both ends re-check. */
+static void lfsm_dep_del(struct lfsm_dep *dep)
+{
+    list_del_rcu(&dep->parent_entry);
+    list_del_rcu(&dep->child_entry);
+    lfsm_dep_kick(dep->parent);
+    lfsm_dep_kick(dep->child);
+    kfree_rcu(dep, rcu);
+}
+
+/**
+ * lfsm_instance_add_dependency - Makes one link depend on another.
+ * @child: The dependent link, e.g. a bond or tunnel.
+ * @parent: The lower link @child runs over.
+ *
+ * From now on a LINK_UP of @child waits until @parent is UP, and a
+ * LINK_DOWN of @parent first takes @child down and waits for it; @child
+ * also follows @parent down when @parent fails or times out. Requests are
+ * still accepted at once, so a driver may ask a whole topology up in one
+ * go and let each link start as soon as its parents are up. Urgent
+ * requests and lfsm_instance_force_down() ignore dependencies.
+ *
+ * Context: Process context, may sleep.
+ * Return: 0 on success, -EINVAL if @child is @parent, -EEXIST if the
+ * dependency exists, -ELOOP if it would close a cycle, -EMLINK if @parent
+ * has more than LFSM_DEP_MAX_DEPTH levels of ancestors, -ENOMEM.
+ */
+int lfsm_instance_add_dependency(struct lfsm_instance *child, struct lfsm_instance *parent)
+{
+    struct lfsm_dep *dep;
+    int ret;
+
+    if (child == parent)
+        return -EINVAL;
+
+    dep = kzalloc(sizeof(*dep), GFP_KERNEL);
+    if (!dep)
+        return -ENOMEM;
+    dep->parent = parent;
+    dep->child = child;
+
+    mutex_lock(&lfsm_deps_lock);
+    if (lfsm_dep_find(child, parent)) {
+        ret = -EEXIST;
+        goto fail;
+    }
+    ret = lfsm_dep_reaches(parent, child);
+    if (ret) {
+        if (ret > 0)
+            ret = -ELOOP;
+        goto fail;
+    }
+    list_add_tail_rcu(&dep->parent_entry, &child->dep_parents);
+    list_add_tail_rcu(&dep->child_entry, &parent->dep_children);
+    mutex_unlock(&lfsm_deps_lock);
+
+    pr_debug("LFSM: %s: Depends on %s\n", child->name, parent->name);
+    return 0;
+
+fail:
+    mutex_unlock(&lfsm_deps_lock);
+    kfree(dep);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_add_dependency);
+
+/**
+ * lfsm_instance_remove_dependency - Drops a dependency between two links.
+ * @child: The dependent link.
+ * @parent: The link @child depended on.
+ *
+ * Actions of either link that were waiting only on this dependency are
+ * dispatched. Nothing happens if there was no such dependency.
+ *
+ * Context: Process context, may sleep.
+ */
+void lfsm_instance_remove_dependency(struct lfsm_instance *child, struct lfsm_instance *parent)
+{
+    struct lfsm_dep *dep;
+
+    mutex_lock(&lfsm_deps_lock);
+    dep = lfsm_dep_find(child, parent);
+    if (dep)
+        lfsm_dep_del(dep);
+    mutex_unlock(&lfsm_deps_lock);
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_remove_dependency);
+
+/* Drops every dependency of @inst, which is being destroyed */
+static void lfsm_dep_unlink_all(struct lfsm_instance *inst)
+{
+    struct lfsm_dep *dep, *tmp;
+
+    mutex_lock(&lfsm_deps_lock);
+    list_for_each_entry_safe(dep, tmp, &inst->dep_parents, parent_entry)
+        lfsm_dep_del(dep);
+    list_for_each_entry_safe(dep, tmp, &inst->dep_children, child_entry)
+        lfsm_dep_del(dep);
+    mutex_unlock(&lfsm_deps_lock);
+    /* Dispatchers of former peers may still be walking the edges to @inst */
+    synchronize_rcu();
+    cancel_work_sync(&inst->dep_work);
+}
+
+static struct lfsm_request *lfsm_request_async(struct lfsm_instance *inst,
+                                               enum lfsm_action_type type, gfp_t gfp)
+{
+    struct lfsm_request *req;
+    int ret;
+
+    /* Falls back on the reserve, and only blocking callers wait for it */
+    req = mempool_alloc(lfsm_request_pool, gfp);
+    if (!req)
+        return ERR_PTR(-ENOMEM);
+
+    memset(req, 0, sizeof(*req));
+    kref_init(&req->ref);
+    kref_get(&req->ref); /* one for the caller, one for the FSM */
+    init_completion(&req->done);
+    req->target = lfsm_action_target(type);
+    INIT_LIST_HEAD(&req->node);
+
+    ret = lfsm_request(inst, type, req, gfpflags_allow_blocking(gfp));
+    if (ret) {
+        /* Rejected: the FSM never took its reference */
+        mempool_free(req, lfsm_request_pool);
+        return ERR_PTR(ret);
+    }
+    return req;
+}
+
+/**
+ * lfsm_instance_link_up_async - As lfsm_instance_link_up(), with a handle.
+ * @inst: The LFSM instance to act on.
+ *
+ * The returned handle is finished once the link is UP because of this
+ * request, or the request has failed. Wait for it with lfsm_request_wait()
+ * and release it with lfsm_request_put(). Handles are taken with
+ * GFP_NOWAIT from a preallocated pool, so atomic callers get one even when
+ * the slab allocator cannot serve them; the allocation never sleeps.
+ *
+ * Context: Any context.
+ * Return: A request handle, or an ERR_PTR() with the error
+ * lfsm_instance_link_up() would have returned, or -ENOMEM in atomic
+ * context with the pool exhausted.
+ */
+struct lfsm_request *lfsm_instance_link_up_async(struct lfsm_instance *inst)
+{
+    return lfsm_request_async(inst, LFSM_ACT_LINK_UP, GFP_NOWAIT);
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_link_up_async);
+
+/**
+ * lfsm_instance_link_down_async - As lfsm_instance_link_down(), with a handle.
+ * @inst: The LFSM instance to act on.
+ *
+ * See lfsm_instance_link_up_async().
+ *
+ * Context: Any context.
+ * Return: A request handle or an ERR_PTR().
+ */
+struct lfsm_request *lfsm_instance_link_down_async(struct lfsm_instance *inst)
+{
+    return lfsm_request_async(inst, LFSM_ACT_LINK_DOWN, GFP_NOWAIT);
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_link_down_async);
+
+/**
+ * lfsm_request_wait - Waits for a request to finish.
+ * @req: Handle from lfsm_instance_link_up_async()/_down_async().
+ * @timeout: Longest wait in jiffies, or MAX_SCHEDULE_TIMEOUT.
+ *
+ * Context: Process context, may sleep.
+ * Return: 0 if the link reached the requested state, the driver's error if
+ * the transition failed, -ETIMEDOUT if it exceeded the instance's
+ * timeout_ms, -ECANCELED if it was cancelled or superseded, or
+ * -EINPROGRESS if @timeout passed first. The request stays valid either way.
+ */
+int lfsm_request_wait(struct lfsm_request *req, unsigned long timeout)
+{
+    if (!wait_for_completion_timeout(&req->done, timeout))
+        return -EINPROGRESS;
+    return READ_ONCE(req->status);
+}
+EXPORT_SYMBOL_GPL(lfsm_request_wait);
+
+/**
+ * lfsm_request_put - Releases a request handle.
+ * @req: Handle to release; the request itself carries on if still pending.
+ *
+ * Context: Any context.
+ */
+void lfsm_request_put(struct lfsm_request *req)
+{
+    kref_put(&req->ref, lfsm_request_release);
+}
+EXPORT_SYMBOL_GPL(lfsm_request_put);
+
+static int lfsm_request_and_wait(struct lfsm_instance *inst, enum lfsm_action_type type,
+                                 unsigned int timeout_ms)
+{
+    struct lfsm_request *req;
+    int ret;
+
+    req = lfsm_request_async(inst, type, GFP_KERNEL);
+    if (IS_ERR(req))
+        return PTR_ERR(req);
+
+    ret = lfsm_request_wait(req, timeout_ms ? msecs_to_jiffies(timeout_ms) : MAX_SCHEDULE_TIMEOUT);
+    lfsm_request_put(req);
+    return ret;
+}
+
+/**
+ * lfsm_instance_link_up_wait - Brings the link up and waits for the outcome.
+ * @inst: The LFSM instance to act on.
+ * @timeout_ms: Longest wait, 0 to wait until the request finishes.
+ *
+ * Context: Process context, may sleep.
+ * Return: As lfsm_request_wait(), or the error lfsm_instance_link_up()
+ * would have returned.
+ */
+int lfsm_instance_link_up_wait(struct lfsm_instance *inst, unsigned int timeout_ms)
+{
+    return lfsm_request_and_wait(inst, LFSM_ACT_LINK_UP, timeout_ms);
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_link_up_wait);
+
+/**
+ * lfsm_instance_link_down_wait - Takes the link down and waits for the outcome.
+ * @inst: The LFSM instance to act on.
+ * @timeout_ms: Longest wait, 0 to wait until the request finishes.
+ *
+ * Context: Process context, may sleep.
+ * Return: As lfsm_instance_link_up_wait().
+ */
+int lfsm_instance_link_down_wait(struct lfsm_instance *inst, unsigned int timeout_ms)
+{
+    return lfsm_request_and_wait(inst, LFSM_ACT_LINK_DOWN, timeout_ms);
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_link_down_wait);
+
+/**
+ * lfsm_instance_set_coalesce - Enables or disables action coalescing.
+ * @inst: The LFSM instance to configure.
+ * @enable: true to coalesce redundant actions.
+ *
+ * While enabled, UP/DOWN requests are folded into the queue so that only
+ * the net target state is left pending; every request that is dropped
+ * this way is counted in the instance's elided counter. Enabling it also
+ * compacts whatever is already queued.
+ *
+ * Context: Any context.
+ */
+void lfsm_instance_set_coalesce(struct lfsm_instance *inst, bool enable)
+{
+    unsigned long flags;
+
+    lfsm_lock_irqsave(inst, flags);
+    inst->coalesce = enable;
+    if (enable)
+        lfsm_compact_queue(inst);
+    spin_unlock_irqrestore(&inst->lock, flags);
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_set_coalesce);
+
+/**
+ * lfsm_instance_set_queue_depth - Resizes an instance's action queue.
+ * @inst: The LFSM instance to configure.
+ * @depth: New number of queue slots, rounded up to a power of two.
+ *
+ * Pending actions are carried over in order.
+ *
+ * Context: Process context, may sleep.
+ * Return: 0 on success, -EINVAL if @depth is out of range, -ENOMEM, or
+ * -EBUSY if more actions are pending than the new queue can hold.
+ */
+int lfsm_instance_set_queue_depth(struct lfsm_instance *inst, unsigned int depth)
+{
+    lfsm_action_fifo fifo, old;
+    struct lfsm_action act;
+    unsigned long flags;
+    int ret;
+
+    if (depth < 2 || depth > LFSM_QUEUE_MAX)
+        return -EINVAL;
+
+    ret = kfifo_alloc(&fifo, depth, GFP_KERNEL);
+    if (ret)
+        return ret;
+
+    lfsm_lock_irqsave(inst, flags);
+    if (kfifo_len(&inst->queue) > kfifo_size(&fifo)) {
+        spin_unlock_irqrestore(&inst->lock, flags);
+        kfifo_free(&fifo);
+        return -EBUSY;
+    }
+
+    while (kfifo_get(&inst->queue, &act))
+        kfifo_put(&fifo, act);
+    old = inst->queue;
+    inst->queue = fifo;
+    spin_unlock_irqrestore(&inst->lock, flags);
+
+    kfifo_free(&old);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_set_queue_depth);
+
+/**
+ * lfsm_instance_set_overflow_policy - Chooses what happens on a full queue.
+ * @inst: The LFSM instance to configure.
+ * @policy: One of enum lfsm_overflow_policy.
+ *
+ * Context: Any context.
+ * Return: 0 on success, -EINVAL for an unknown policy.
+ */
+int lfsm_instance_set_overflow_policy(struct lfsm_instance *inst,
+                                      enum lfsm_overflow_policy policy)
+{
+    unsigned long flags;
+
+    if (policy >= LFSM_OVERFLOW_MAX)
+        return -EINVAL;
+
+    lfsm_lock_irqsave(inst, flags);
+    inst->overflow_policy = policy;
+    spin_unlock_irqrestore(&inst->lock, flags);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_set_overflow_policy);
+
+/**
+ * lfsm_instance_set_direct_dispatch - Lets callers start idle transitions.
+ * @inst: The LFSM instance to configure.
+ * @enable: true to allow direct dispatch.
+ *
+ * While enabled, lfsm_instance_link_up_sync()/_down_sync() and the _wait
+ * variants called on an idle instance move it to LINK_STARTING/
+ * LINK_STOPPING and call the driver op before returning, rather than
+ * leaving that to the LFSM workqueue. Driver ops then run in the caller's
+ * context. The plain lfsm_instance_link_up()/_down() may be called from
+ * any context and always go through the workqueue.
+ *
+ * Context: Any context.
+ */
+void lfsm_instance_set_direct_dispatch(struct lfsm_instance *inst, bool enable)
+{
+    WRITE_ONCE(inst->direct_dispatch, enable);
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_set_direct_dispatch);
+
+/**
+ * lfsm_instance_set_highpri - Runs the instance's work on WQ_HIGHPRI workers.
+ * @inst: The LFSM instance to configure.
+ * @highpri: true for high-priority workers.
+ *
+ * Applies to work queued from now on.
+ *
+ * Context: Any context.
+ */
+void lfsm_instance_set_highpri(struct lfsm_instance *inst, bool highpri)
+{
+    WRITE_ONCE(inst->highpri, highpri);
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_set_highpri);
+
+/**
+ * lfsm_instance_set_numa_node - Keeps the instance's work on a NUMA node.
+ * @inst: The LFSM instance to configure.
+ * @node: Node to run on, typically dev_to_node() of the link's device, or
+ *        NUMA_NO_NODE for no preference.
+ *
+ * Ignored while a CPU mask is set with lfsm_instance_set_cpumask().
+ *
+ * Context: Any context.
+ * Return: 0 on success, -EINVAL if @node is not an online node.
+ */
+int lfsm_instance_set_numa_node(struct lfsm_instance *inst, int node)
+{
+    if (node != NUMA_NO_NODE &&
+        (node < 0 || node >= nr_node_ids || !node_online(node)))
+        return -EINVAL;
+
+    WRITE_ONCE(inst->numa_node, node);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_set_numa_node);
+
+/**
+ * lfsm_instance_set_cpumask - Restricts the instance's work to some CPUs.
+ * @inst: The LFSM instance to configure.
+ * @mask: CPUs to run on, or NULL or an empty mask to lift the restriction.
+ *
+ * Work is queued to a bound workqueue on an online CPU of @mask, falling
+ * back to unbound work if all of them go offline.
+ *
+ * Context: Any context.
+ * Return: 0 on success, -EINVAL if @mask has no online CPU.
+ */
+int lfsm_instance_set_cpumask(struct lfsm_instance *inst, const struct cpumask *mask)
+{
+    unsigned long flags;
+    bool set = mask && !cpumask_empty(mask);
+
+    if (set && !cpumask_intersects(mask, cpu_online_mask))
+        return -EINVAL;
+
+    lfsm_lock_irqsave(inst, flags);
+    if (set)
+        cpumask_copy(inst->cpumask, mask);
+    else
+        cpumask_clear(inst->cpumask);
+    WRITE_ONCE(inst->cpumask_set, set);
+    spin_unlock_irqrestore(&inst->lock, flags);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_set_cpumask);
+
+/**
+ * lfsm_instance_checkpoint - Saves an instance for lfsm_instance_restore().
+ * @inst: The LFSM instance to save.
+ *
+ * Captures @inst's state, configuration and pending actions, so that an
+ * instance created later, typically by a reloaded module, carries on from
+ * there without re-running transitions. Request handles, held requests
+ * and dependencies are not saved.
+ *
+ * Context: Process context, may sleep.
+ * Return: A checkpoint to free with kfree(), or ERR_PTR(-ENOMEM).
+ */
+struct lfsm_checkpoint *lfsm_instance_checkpoint(struct lfsm_instance *inst)
+{
+    struct lfsm_checkpoint *cp;
+    struct lfsm_action *q;
+    enum link_state state;
+    unsigned int i, size;
+
+    lfsm_lock_irq(inst);
+    size = kfifo_size(&inst->queue);
+    spin_unlock_irq(&inst->lock);
+
+    cp = kzalloc(struct_size(cp, actions, LFSM_PRIO_LEN + size), GFP_KERNEL);
+    q = kmalloc_array(LFSM_PRIO_LEN + size, sizeof(*q), GFP_KERNEL);
+    if (!cp || !q) {
+        kfree(q);
+        kfree(cp);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    lfsm_lock_irq(inst);
+    state = lfsm_read_state(inst);
+    if (lfsm_state_transitional(inst, state))
+        state = lfsm_lookup(inst, state, LFSM_TRIG_FAILED)->next;
+    cp->state = state;
+    cp->delay_ms = inst->delay_ms;
+    cp->timeout_ms = inst->timeout_ms;
+    cp->queue_depth = kfifo_size(&inst->queue);
+    cp->overflow_policy = inst->overflow_policy;
+    cp->coalesce = inst->coalesce;
+    /* The queue may have been resized meanwhile; peek at most @size entries */
+    cp->n_urgent = kfifo_out_peek(&inst->prio, q, LFSM_PRIO_LEN);
+    cp->n_actions = cp->n_urgent + kfifo_out_peek(&inst->queue, q + cp->n_urgent, size);
+    spin_unlock_irq(&inst->lock);
+
+    for (i = 0; i < cp->n_actions; i++)
+        cp->actions[i] = q[i].type;
+    kfree(q);
+    return cp;
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_checkpoint);
+
+/* Caller holds inst->lock */
+static bool lfsm_instance_pristine(struct lfsm_instance *inst)
+{
+    return lfsm_read_state(inst) == inst->table->initial && !inst->work_active &&
+           kfifo_is_empty(&inst->queue) && kfifo_is_empty(&inst->prio);
+}
+
+/**
+ * lfsm_instance_restore - Resumes an instance from a checkpoint.
+ * @inst: The LFSM instance to resume, idle in its initial state.
+ * @cp: Checkpoint from lfsm_instance_checkpoint() of an instance running
+ *      the same table.
+ *
+ * Applies @cp's configuration, moves @inst straight to @cp's state without
+ * calling any driver op, and queues @cp's actions, the urgent ones back on
+ * the priority lane. Subscribers see the move as an LFSM_CAUSE_RESTORE event. It is
+ * up to the driver that the link really is in that state, e.g. because
+ * the hardware was left running across a module reload.
+ *
+ * Context: Process context, may sleep.
+ * Return: 0 on success, -EINVAL if @cp does not fit @inst's table, -EBUSY
+ * if @inst has left its initial state or has actions pending, -ENODEV once
+ * @inst is being destroyed, or an error of the configuration setters.
+ */
+int lfsm_instance_restore(struct lfsm_instance *inst, const struct lfsm_checkpoint *cp)
+{
+    const struct lfsm_table *table = inst->table;
+    struct lfsm_action act = {};
+    enum link_state state;
+    struct lfsm_event ev;
+    bool moved = false;
+    unsigned int i;
+    int ret;
+
+    if (cp->state >= table->n_states || lfsm_state_transitional(inst, cp->state))
+        return -EINVAL;
+    if (cp->n_urgent > cp->n_actions || cp->n_urgent > LFSM_PRIO_LEN ||
+        cp->n_actions - cp->n_urgent > LFSM_QUEUE_MAX)
+        return -EINVAL;
+    for (i = 0; i < cp->n_actions; i++) {
+        if ((i < cp->n_urgent && cp->actions[i] >= LFSM_ACT_MAX) ||
+            cp->actions[i] >= table->n_triggers ||
+            (cp->actions[i] >= LFSM_ACT_MAX && cp->actions[i] < LFSM_TRIG_CUSTOM))
+            return -EINVAL;
+    }
+
+    lfsm_lock_irq(inst);
+    ret = inst->dead ? -ENODEV : lfsm_instance_pristine(inst) ? 0 : -EBUSY;
+    spin_unlock_irq(&inst->lock);
+    if (ret)
+        return ret;
+
+    ret = lfsm_instance_set_queue_depth(inst, max(cp->queue_depth, cp->n_actions - cp->n_urgent));
+    if (!ret)
+        ret = lfsm_instance_set_overflow_policy(inst, cp->overflow_policy);
+    if (!ret)
+        ret = lfsm_instance_set_timeout_ms(inst, cp->timeout_ms);
+    if (ret)
+        return ret;
+    lfsm_instance_set_delay_ms(inst, cp->delay_ms);
+
+    lfsm_lock_irq(inst);
+    if (inst->dead || !lfsm_instance_pristine(inst)) {
+        ret = inst->dead ? -ENODEV : -EBUSY;
+        goto unlock;
+    }
+
+    act.enqueue_ns = ktime_get_ns();
+    for (i = 0; i < cp->n_actions; i++) {
+        act.type = cp->actions[i];
+        if (i < cp->n_urgent)
+            kfifo_put(&inst->prio, act);
+        else
+            kfifo_put(&inst->queue, act);
+    }
+    inst->coalesce = cp->coalesce;
+    if (inst->coalesce)
+        lfsm_compact_queue(inst);
+
+    state = lfsm_read_state(inst);
+    if (cp->state != state) {
+        lfsm_set_state(inst, cp->state);
+        lfsm_event_init(inst, &ev, state, cp->state, LFSM_CAUSE_RESTORE);
+        /* complete_work delivers the event, then starts on the queue */
+        inst->notify_event = ev;
+        inst->work_active = true;
+        lfsm_queue_work(inst, &inst->complete_work);
+        moved = true;
+    } else if (!kfifo_is_empty(&inst->queue) || !kfifo_is_empty(&inst->prio)) {
+        inst->work_active = true;
+        lfsm_queue_work(inst, &inst->worker);
+    }
+    pr_info("LFSM: %s: Restored in %s with %u pending actions\n", inst->name,
+            lfsm_instance_state_name(inst, cp->state),
+            kfifo_len(&inst->prio) + kfifo_len(&inst->queue));
+unlock:
+    spin_unlock_irq(&inst->lock);
+
+    if (moved)
+        lfsm_event_settled(&ev);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_restore);
+
+static int lfsm_batch_entry_check(const struct lfsm_batch_entry *e)
+{
+    if (!e->inst)
+        return -ENODEV;
+    if (e->target != LINK_UP && e->target != LINK_DOWN)
+        return -EINVAL;
+    return 0;
+}
+
+/* Orders batch indices by instance, keeping each instance's entries in order */
+static int lfsm_batch_order_cmp(const void *a, const void *b, const void *priv)
+{
+    const struct lfsm_batch_entry *entries = priv;
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    unsigned long px = (unsigned long)entries[x].inst, py = (unsigned long)entries[y].inst;
+
+    if (px != py)
+        return px < py ? -1 : 1;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * lfsm_link_set_batch - Requests state changes on many links at once.
+ * @entries: Array of (instance, target state) pairs.
+ * @n: Number of entries in @entries.
+ *
+ * The whole batch is validated before anything is queued: if any entry has
+ * no instance (-ENODEV) or a target other than LINK_UP/LINK_DOWN (-EINVAL),
+ * that error is stored in its status, every other entry gets -ECANCELED,
+ * and nothing is queued. Otherwise each entry is handled exactly like
+ * lfsm_instance_link_up()/lfsm_instance_link_down() and its result stored
+ * in ->status. Entries are grouped by instance wherever they appear in
+ * @entries, so each instance's lock is taken once and its dispatcher is
+ * kicked at most once; entries for one instance are applied in array order.
+ * If the grouping index cannot be allocated, only consecutive entries for
+ * the same instance share a lock acquisition.
+ *
+ * Context: Any context.
+ * Return: 0 if every entry succeeded, otherwise the first failing status.
+ */
+int lfsm_link_set_batch(struct lfsm_batch_entry *entries, unsigned int n)
+{
+    struct lfsm_instance *locked = NULL;
+    unsigned long flags = 0;
+    unsigned int *order;
+    unsigned int i, k;
+    int ret = 0;
+
+    for (i = 0; i < n; i++) {
+        entries[i].status = lfsm_batch_entry_check(&entries[i]);
+        if (entries[i].status && !ret)
+            ret = entries[i].status;
+    }
+    if (ret) {
+        for (i = 0; i < n; i++) {
+            if (!entries[i].status)
+                entries[i].status = -ECANCELED;
+        }
+        return ret;
+    }
+
+    order = kmalloc_array(n, sizeof(*order), GFP_ATOMIC | __GFP_NOWARN);
+    if (order) {
+        for (i = 0; i < n; i++)
+            order[i] = i;
+        sort_r(order, n, sizeof(*order), lfsm_batch_order_cmp, NULL, entries);
+    }
+
+    for (k = 0; k < n; k++) {
+        struct lfsm_batch_entry *e = &entries[order ? order[k] : k];
+
+        if (e->inst != locked) {
+            if (locked)
+                spin_unlock_irqrestore(&locked->lock, flags);
+            locked = e->inst;
+            lfsm_lock_irqsave(locked, flags);
+        }
+
+        e->status = lfsm_request_action(e->inst, e->target == LINK_UP ?
+                                        LFSM_ACT_LINK_UP : LFSM_ACT_LINK_DOWN, NULL);
+        if (e->status && !ret)
+            ret = e->status;
+    }
+    if (locked)
+        spin_unlock_irqrestore(&locked->lock, flags);
+    kfree(order);
+
+    return ret;
+}
+EXPORT_SYMBOL_GPL(lfsm_link_set_batch);
+
+/**
+ * lfsm_instance_get_link_state - Retrieve the current state of an instance.
+ * @inst: The LFSM instance to query.
+ *
+ * Context: Any context. Does not take the instance lock.
+ * Return: The current link state of @inst.
+ */
+enum link_state lfsm_instance_get_link_state(struct lfsm_instance *inst)
+{
+    return lfsm_read_state(inst);
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_get_link_state);
+
+/**
+ * lfsm_instance_get_link_state_gen - Retrieve state and transition generation.
+ * @inst: The LFSM instance to query.
+ * @gen: Filled with the generation number of the returned state.
+ *
+ * The generation is incremented on every state change, so a caller that
+ * caches it can detect any intervening transition by comparing numbers,
+ * even if the link ended up back in the same state.
+ *
+ * Context: Any context. Does not take the instance lock.
+ * Return: The current link state of @inst.
+ */
+enum link_state lfsm_instance_get_link_state_gen(struct lfsm_instance *inst, u64 *gen)
+{
+    u64 v = atomic64_read(&inst->state_gen);
+
+    if (gen)
+        *gen = v >> LFSM_STATE_BITS;
+    return v & LFSM_STATE_MASK;
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_get_link_state_gen);
+
+/**
+ * lfsm_instance_lock_contended - Contention count of an instance's lock.
+ * @inst: The LFSM instance to query.
+ *
+ * Return: How many acquisitions of @inst's lock had to wait since it was
+ * created. The query itself is not counted.
+ */
+u64 lfsm_instance_lock_contended(struct lfsm_instance *inst)
+{
+    unsigned long flags;
+    u64 n;
+
+    spin_lock_irqsave(&inst->lock, flags);
+    n = inst->lock_contended;
+    spin_unlock_irqrestore(&inst->lock, flags);
+    return n;
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_lock_contended);
+
+/**
+ * lfsm_instance_force_down - Forcefully resets an instance to LINK_DOWN.
+ * @inst: The LFSM instance to reset.
+ *
+ * Cancels all pending work for @inst, drops its queued and urgent actions
+ * and puts the link in LINK_DOWN, or the initial state of its table,
+ * without running a transition. Unless the link was already there,
+ * subscribers get an LFSM_CAUSE_CANCEL event before this returns. A
+ * completion event that had not been delivered yet is dropped, leaving a
+ * gap in the instance's event sequence. lfsm_instance_link_down_urgent()
+ * is the cheaper way down when no reset is needed.
+ *
+ * Context: Process context, may sleep.
+ */
+void lfsm_instance_force_down(struct lfsm_instance *inst)
+{
+    enum link_state state, reset = inst->table->initial;
+    struct lfsm_event ev;
+    u64 aborted;
+
+    might_sleep();
+    cancel_work_sync(&inst->worker);
+    /* An expiring timeout hands its event to complete_work */
+    lfsm_timeout_cancel_sync(inst);
+    cancel_work_sync(&inst->complete_work);
+    /* A parallel fan-out, or the completion just cancelled, may requeue it */
+    flush_workqueue(lfsm_notify_wq);
+    cancel_work_sync(&inst->worker);
+    cancel_delayed_work_sync(&inst->delay_work);
+    hrtimer_cancel(&inst->hold_timer);
+
+    lfsm_lock_irq(inst);
+    state = lfsm_read_state(inst);
+    trace_lfsm_force_down(inst->id, inst->name, state, lfsm_instance_state_name(inst, state));
+    lfsm_flush_queue(inst);
+    lfsm_flush_urgent(inst);
+    lfsm_note_abort(inst);
+    /* Also takes one owed by the completion cancelled above */
+    aborted = lfsm_take_abort(inst);
+    lfsm_set_state(inst, reset);
+    lfsm_settle_requests(inst, reset, -ECANCELED);
+    lfsm_request_finish(inst->held_req, -ECANCELED);
+    inst->held_type = LFSM_ACT_MAX;
+    inst->held_req = NULL;
+    if (state != reset)
+        lfsm_event_init(inst, &ev, state, reset, LFSM_CAUSE_CANCEL);
+    inst->work_active = false;
+    pr_info("LFSM: %s: Cancelled all and forced link %s\n", inst->name,
+            lfsm_instance_state_name(inst, reset));
+    lfsm_stat_inc(LFSM_STAT_FORCE_DOWNS);
+    spin_unlock_irq(&inst->lock);
+
+    lfsm_call_abort(inst, aborted);
+    if (state != reset) {
+        lfsm_event_settled(&ev);
+        lfsm_deliver_event(&ev, false);
+    }
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_force_down);
+
+/*
+ * Caller holds inst->lock. Moves a pending per-transition timer so that it
+ * expires @ms after the current transition started, firing at once if that
+ * point has already passed, and records the new expiry in @deadline. Idle
+ * timers are left alone.
+ */
+static void lfsm_rearm_timer(struct lfsm_instance *inst, struct delayed_work *dwork,
+                             unsigned long *deadline, unsigned int ms)
+{
+    unsigned long expires = inst->transition_start + msecs_to_jiffies(ms);
+
+    lockdep_assert_held(&inst->lock);
+    if (!delayed_work_pending(dwork))
+        return;
+
+    *deadline = expires;
+    lfsm_mod_delayed_work(inst, dwork,
+                          time_after(expires, jiffies) ? expires - jiffies : 0);
+}
+
+/**
+ * lfsm_instance_set_delay_ms - Changes the fixed transition delay.
+ * @inst: The LFSM instance to configure.
+ * @delay_ms: New delay in milliseconds, 0 for immediate completion.
+ *
+ * Only affects instances created without driver ops. A transition already
+ * in progress is re-armed against the new delay.
+ *
+ * Context: Any context.
+ */
+void lfsm_instance_set_delay_ms(struct lfsm_instance *inst, unsigned int delay_ms)
+{
+    unsigned long flags;
+
+    lfsm_lock_irqsave(inst, flags);
+    inst->delay_ms = delay_ms;
+    lfsm_rearm_timer(inst, &inst->delay_work, &inst->delay_expires, delay_ms);
+    spin_unlock_irqrestore(&inst->lock, flags);
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_set_delay_ms);
+
+/**
+ * lfsm_instance_set_timeout_ms - Changes the transition timeout.
+ * @inst: The LFSM instance to configure.
+ * @timeout_ms: New timeout in milliseconds.
+ *
+ * A transition already in progress is re-armed so that it times out
+ * @timeout_ms after it started, unless its table cell sets its own timeout.
+ *
+ * Context: Any context.
+ * Return: 0 on success, -EINVAL if @timeout_ms is zero.
+ */
+int lfsm_instance_set_timeout_ms(struct lfsm_instance *inst, unsigned int timeout_ms)
+{
+    unsigned long flags;
+
+    if (!timeout_ms)
+        return -EINVAL;
+
+    lfsm_lock_irqsave(inst, flags);
+    inst->timeout_ms = timeout_ms;
+    /* A pending timeout moves to @timeout_ms after the transition started */
+    if (!inst->timeout_fixed && lfsm_timeout_disarm(inst))
+        lfsm_timeout_arm(inst, ktime_add_ms(ns_to_ktime(inst->dispatch_ns), timeout_ms));
+    spin_unlock_irqrestore(&inst->lock, flags);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_set_timeout_ms);
+
+/**
+ * lfsm_instance_set_debounce_ms - Changes the request debounce window.
+ * @inst: The LFSM instance to configure.
+ * @debounce_ms: How long an UP/DOWN request is held before it is queued,
+ *               0 to queue at once.
+ *
+ * A request that is replaced by a different one inside the window never
+ * reaches the queue, so a bouncing carrier costs no transition. Callers
+ * are told a held request succeeded; request handles follow it to its
+ * outcome. A request already held keeps its release time.
+ *
+ * Context: Any context.
+ */
+void lfsm_instance_set_debounce_ms(struct lfsm_instance *inst, unsigned int debounce_ms)
+{
+    unsigned long flags;
+
+    lfsm_lock_irqsave(inst, flags);
+    inst->debounce_ms = debounce_ms;
+    spin_unlock_irqrestore(&inst->lock, flags);
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_set_debounce_ms);
+
+/**
+ * lfsm_instance_set_holddown - Configures the flap hold-down.
+ * @inst: The LFSM instance to configure.
+ * @flaps: Number of flaps, UP requests following a DOWN, that start a
+ *         hold-down; 0 turns it off.
+ * @holddown_ms: Length of the first hold-down.
+ * @max_ms: Cap of the doubling hold-down, and the flap-free time after
+ *          which the count and the period start over.
+ *
+ * During a hold-down UP requests are held until it ends, then queued unless
+ * a DOWN has replaced them. DOWN requests are never held back.
+ *
+ * Context: Any context.
+ * Return: 0 on success, -EINVAL if @flaps is set and @holddown_ms is zero
+ * or above @max_ms.
+ */
+int lfsm_instance_set_holddown(struct lfsm_instance *inst, unsigned int flaps,
+                               unsigned int holddown_ms, unsigned int max_ms)
+{
+    unsigned long flags;
+
+    if (flaps && (!holddown_ms || holddown_ms > max_ms))
+        return -EINVAL;
+
+    lfsm_lock_irqsave(inst, flags);
+    inst->holddown_flaps = flaps;
+    inst->holddown_ms = holddown_ms;
+    inst->holddown_max_ms = max_ms;
+    inst->holddown_cur_ms = holddown_ms;
+    inst->flaps = 0;
+    spin_unlock_irqrestore(&inst->lock, flags);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_set_holddown);
+
+/**
+ * lfsm_link_up - Establishes a link or connection.
+ *
+ * Legacy single-link wrapper around lfsm_instance_link_up() acting on the
+ * default instance.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int lfsm_link_up(void)
+{
+    return lfsm_instance_link_up(lfsm_default);
+}
+EXPORT_SYMBOL_GPL(lfsm_link_up);
+
+/**
+ * lfsm_link_down - Handles the event when a link goes down.
+ *
+ * Legacy single-link wrapper around lfsm_instance_link_down() acting on
+ * the default instance.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int lfsm_link_down(void)
+{
+    return lfsm_instance_link_down(lfsm_default);
+}
+EXPORT_SYMBOL_GPL(lfsm_link_down);
+
+/**
+ * lfsm_link_up_wait - Brings the default link up and waits for the outcome.
+ * @timeout_ms: Longest wait, 0 to wait until the request finishes.
+ *
+ * Legacy single-link wrapper around lfsm_instance_link_up_wait().
+ *
+ * Context: Process context, may sleep.
+ * Return: 0 once the link is UP, negative error code on failure.
+ */
+int lfsm_link_up_wait(unsigned int timeout_ms)
+{
+    return lfsm_instance_link_up_wait(lfsm_default, timeout_ms);
+}
+EXPORT_SYMBOL_GPL(lfsm_link_up_wait);
+
+/**
+ * lfsm_link_down_wait - Takes the default link down and waits for the outcome.
+ * @timeout_ms: Longest wait, 0 to wait until the request finishes.
+ *
+ * Legacy single-link wrapper around lfsm_instance_link_down_wait().
+ *
+ * Context: Process context, may sleep.
+ * Return: 0 once the link is DOWN, negative error code on failure.
+ */
+int lfsm_link_down_wait(unsigned int timeout_ms)
+{
+    return lfsm_instance_link_down_wait(lfsm_default, timeout_ms);
+}
+EXPORT_SYMBOL_GPL(lfsm_link_down_wait);
+
+/**
+ * lfsm_get_link_state - Retrieve the current state of the link.
+ *
+ * This function returns the current state of the default instance as an
+ * enum link_state value.
+ *
+ * Return: The current link state.
+ */
+enum link_state lfsm_get_link_state(void)
+{
+    return lfsm_instance_get_link_state(lfsm_default);
+}
+EXPORT_SYMBOL_GPL(lfsm_get_link_state);
+
+/**
+ * lfsm_get_link_state_gen - Retrieve state and generation of the link.
+ * @gen: Filled with the generation number of the returned state.
+ *
+ * Default-instance wrapper around lfsm_instance_get_link_state_gen().
+ *
+ * Return: The current link state.
+ */
+enum link_state lfsm_get_link_state_gen(u64 *gen)
+{
+    return lfsm_instance_get_link_state_gen(lfsm_default, gen);
+}
+EXPORT_SYMBOL_GPL(lfsm_get_link_state_gen);
+
+/**
+ * lfsm_force_down - Forcefully shuts down the LFSM subsystem.
+ *
+ * This function initiates a forced shutdown of the default instance. It
+ * is typically used in scenarios where a graceful shutdown is not possible
+ * or when an emergency stop is required to prevent further operations.
+ *
+ * Context: May be called in critical error handling paths.
+ */
+void lfsm_force_down(void)
+{
+    lfsm_instance_force_down(lfsm_default);
+}
+EXPORT_SYMBOL_GPL(lfsm_force_down);
+
+// --- sysfs ---
+static ssize_t lfsm_state_show(struct lfsm_instance *inst, char *buf)
+{
+    return sprintf(buf, "%s\n",
+                   lfsm_instance_state_name(inst, lfsm_instance_get_link_state(inst)));
+}
+
+/* Urgent actions come first, in dispatch order, marked as such */
+static ssize_t lfsm_queue_show(struct lfsm_instance *inst, char *buf)
+{
+    struct lfsm_action *q;
+    unsigned int i, n, np, size;
+    ssize_t len = 0;
+    unsigned long flags;
+
+    lfsm_lock_irqsave(inst, flags);
+    size = kfifo_size(&inst->queue);
+    spin_unlock_irqrestore(&inst->lock, flags);
+
+    q = kmalloc_array(LFSM_PRIO_LEN + size, sizeof(*q), GFP_KERNEL);
+    if (!q)
+        return -ENOMEM;
+
+    /* The queue may have been resized meanwhile; peek at most @size entries */
+    lfsm_lock_irqsave(inst, flags);
+    np = kfifo_out_peek(&inst->prio, q, LFSM_PRIO_LEN);
+    n = np + kfifo_out_peek(&inst->queue, q + np, size);
+    spin_unlock_irqrestore(&inst->lock, flags);
+
+    for (i = 0; i < n; i++)
+        len += scnprintf(buf + len, PAGE_SIZE - len, "%s%s\n",
+                         lfsm_trigger_name(inst, q[i].type), i < np ? " urgent" : "");
+    kfree(q);
+    return len;
+}
+
+/* Top-level files report the default instance */
+static ssize_t state_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return lfsm_state_show(lfsm_default, buf);
+}
+static struct kobj_attribute state_attr = __ATTR_RO(state);
+
+static ssize_t queue_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return lfsm_queue_show(lfsm_default, buf);
+}
+static struct kobj_attribute queue_attr = __ATTR_RO(queue);
+
+/*
+ * One "name value" line per counter, then one line per histogram holding
+ * the histogram name followed by its LFSM_HIST_BUCKETS bucket counts.
+ */
+static ssize_t stats_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    struct lfsm_stats *sum;
+    ssize_t len = 0;
+    int i, b;
+
+    sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+    if (!sum)
+        return -ENOMEM;
+    lfsm_stats_sum(sum);
+
+    for (i = 0; i < LFSM_STAT_MAX; i++)
+        len += scnprintf(buf + len, PAGE_SIZE - len, "%s %llu\n",
+                         lfsm_stat_str[i], sum->count[i]);
+    for (i = 0; i < LFSM_HIST_MAX; i++) {
+        len += scnprintf(buf + len, PAGE_SIZE - len, "%s", lfsm_hist_str[i]);
+        for (b = 0; b < LFSM_HIST_BUCKETS; b++)
+            len += scnprintf(buf + len, PAGE_SIZE - len, " %llu", sum->hist[i][b]);
+        len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+    }
+
+    kfree(sum);
+    return len;
+}
+static struct kobj_attribute stats_attr = __ATTR_RO(stats);
+
+static ssize_t lfsm_subscribers_show(struct list_head *subs, const char *kind,
+                                     char *buf, ssize_t len)
+{
+    struct lfsm_subscriber *sub;
+
+    list_for_each_entry_rcu(sub, subs, node, lockdep_is_held(&lfsm_blocking_subs_rwsem)) {
+        len += scnprintf(buf + len, PAGE_SIZE - len,
+                         "%s %ps calls %lld total_ns %lld max_ns %lld\n",
+                         kind, sub->nb->notifier_call,
+                         atomic64_read(&sub->calls),
+                         atomic64_read(&sub->total_ns),
+                         atomic64_read(&sub->max_ns));
+    }
+    return len;
+}
+
+/*
+ * One line per subscriber, atomic ones first, each list in call order:
+ * "<kind> <callback> calls <n> total_ns <ns> max_ns <ns>".
+ */
+static ssize_t subscribers_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    ssize_t len;
+
+    rcu_read_lock();
+    len = lfsm_subscribers_show(&lfsm_atomic_subs, "atomic", buf, 0);
+    rcu_read_unlock();
+
+    down_read(&lfsm_blocking_subs_rwsem);
+    len = lfsm_subscribers_show(&lfsm_blocking_subs, "blocking", buf, len);
+    up_read(&lfsm_blocking_subs_rwsem);
+    return len;
+}
+static struct kobj_attribute subscribers_attr = __ATTR_RO(subscribers);
+
+static struct attribute *lfsm_attrs[] = {
+    &state_attr.attr,
+    &queue_attr.attr,
+    &stats_attr.attr,
+    &subscribers_attr.attr,
+    NULL,
+};
+
+static struct attribute_group lfsm_attr_group = {
+    .attrs = lfsm_attrs,
 };
 
-static const char * const lfsm_action_str[] = {
-    [LFSM_ACT_LINK_UP]   = "LINK_UP",
-    [LFSM_ACT_LINK_DOWN] = "LINK_DOWN",
-};
+/* Per-instance files under /sys/kernel/lfsm/<name>/ */
+#define to_lfsm_instance(k) container_of(k, struct lfsm_instance, kobj)
+
+static ssize_t inst_state_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return lfsm_state_show(to_lfsm_instance(kobj), buf);
+}
+static struct kobj_attribute inst_state_attr = __ATTR(state, 0444, inst_state_show, NULL);
+
+static ssize_t inst_queue_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return lfsm_queue_show(to_lfsm_instance(kobj), buf);
+}
+static struct kobj_attribute inst_queue_attr = __ATTR(queue, 0444, inst_queue_show, NULL);
+
+static ssize_t inst_id_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", to_lfsm_instance(kobj)->id);
+}
+static struct kobj_attribute inst_id_attr = __ATTR(id, 0444, inst_id_show, NULL);
+
+static ssize_t inst_delay_ms_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", READ_ONCE(to_lfsm_instance(kobj)->delay_ms));
+}
+
+static ssize_t inst_delay_ms_store(struct kobject *kobj, struct kobj_attribute *attr,
+                                   const char *buf, size_t count)
+{
+    unsigned int val;
+    int ret;
+
+    ret = kstrtouint(buf, 0, &val);
+    if (ret)
+        return ret;
+
+    lfsm_instance_set_delay_ms(to_lfsm_instance(kobj), val);
+    return count;
+}
+static struct kobj_attribute inst_delay_ms_attr =
+    __ATTR(delay_ms, 0644, inst_delay_ms_show, inst_delay_ms_store);
+
+static ssize_t inst_timeout_ms_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", READ_ONCE(to_lfsm_instance(kobj)->timeout_ms));
+}
+
+static ssize_t inst_timeout_ms_store(struct kobject *kobj, struct kobj_attribute *attr,
+                                     const char *buf, size_t count)
+{
+    unsigned int val;
+    int ret;
+
+    ret = kstrtouint(buf, 0, &val);
+    if (ret)
+        return ret;
+
+    ret = lfsm_instance_set_timeout_ms(to_lfsm_instance(kobj), val);
+    return ret ? ret : count;
+}
+static struct kobj_attribute inst_timeout_ms_attr =
+    __ATTR(timeout_ms, 0644, inst_timeout_ms_show, inst_timeout_ms_store);
+
+static ssize_t inst_coalesce_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%d\n", READ_ONCE(to_lfsm_instance(kobj)->coalesce));
+}
+
+static ssize_t inst_coalesce_store(struct kobject *kobj, struct kobj_attribute *attr,
+                                   const char *buf, size_t count)
+{
+    bool val;
+    int ret;
+
+    ret = kstrtobool(buf, &val);
+    if (ret)
+        return ret;
+
+    lfsm_instance_set_coalesce(to_lfsm_instance(kobj), val);
+    return count;
+}
+static struct kobj_attribute inst_coalesce_attr =
+    __ATTR(coalesce, 0644, inst_coalesce_show, inst_coalesce_store);
+
+static ssize_t inst_debounce_ms_show(struct kobject *kobj, struct kobj_attribute *attr,
+                                     char *buf)
+{
+    return sprintf(buf, "%u\n", READ_ONCE(to_lfsm_instance(kobj)->debounce_ms));
+}
+
+static ssize_t inst_debounce_ms_store(struct kobject *kobj, struct kobj_attribute *attr,
+                                      const char *buf, size_t count)
+{
+    unsigned int val;
+    int ret;
+
+    ret = kstrtouint(buf, 0, &val);
+    if (ret)
+        return ret;
+
+    lfsm_instance_set_debounce_ms(to_lfsm_instance(kobj), val);
+    return count;
+}
+static struct kobj_attribute inst_debounce_ms_attr =
+    __ATTR(debounce_ms, 0644, inst_debounce_ms_show, inst_debounce_ms_store);
+
+enum lfsm_holddown_field { LFSM_HD_FLAPS, LFSM_HD_MS, LFSM_HD_MAX_MS };
+
+static ssize_t lfsm_holddown_show(struct kobject *kobj, char *buf, enum lfsm_holddown_field f)
+{
+    struct lfsm_instance *inst = to_lfsm_instance(kobj);
+    unsigned int val[] = {
+        [LFSM_HD_FLAPS]  = READ_ONCE(inst->holddown_flaps),
+        [LFSM_HD_MS]     = READ_ONCE(inst->holddown_ms),
+        [LFSM_HD_MAX_MS] = READ_ONCE(inst->holddown_max_ms),
+    };
+
+    return sprintf(buf, "%u\n", val[f]);
+}
+
+/* Changes one of the three settings, keeping the other two */
+static ssize_t lfsm_holddown_store(struct kobject *kobj, const char *buf, size_t count,
+                                   enum lfsm_holddown_field f)
+{
+    struct lfsm_instance *inst = to_lfsm_instance(kobj);
+    unsigned int val[3];
+    unsigned long flags;
+    int ret;
+
+    lfsm_lock_irqsave(inst, flags);
+    val[LFSM_HD_FLAPS] = inst->holddown_flaps;
+    val[LFSM_HD_MS] = inst->holddown_ms;
+    val[LFSM_HD_MAX_MS] = inst->holddown_max_ms;
+    spin_unlock_irqrestore(&inst->lock, flags);
+
+    ret = kstrtouint(buf, 0, &val[f]);
+    if (ret)
+        return ret;
+
+    ret = lfsm_instance_set_holddown(inst, val[LFSM_HD_FLAPS], val[LFSM_HD_MS],
+                                     val[LFSM_HD_MAX_MS]);
+    return ret ? ret : count;
+}
+
+static ssize_t inst_holddown_flaps_show(struct kobject *kobj, struct kobj_attribute *attr,
+                                        char *buf)
+{
+    return lfsm_holddown_show(kobj, buf, LFSM_HD_FLAPS);
+}
+
+static ssize_t inst_holddown_flaps_store(struct kobject *kobj, struct kobj_attribute *attr,
+                                         const char *buf, size_t count)
+{
+    return lfsm_holddown_store(kobj, buf, count, LFSM_HD_FLAPS);
+}
+static struct kobj_attribute inst_holddown_flaps_attr =
+    __ATTR(holddown_flaps, 0644, inst_holddown_flaps_show, inst_holddown_flaps_store);
+
+static ssize_t inst_holddown_ms_show(struct kobject *kobj, struct kobj_attribute *attr,
+                                     char *buf)
+{
+    return lfsm_holddown_show(kobj, buf, LFSM_HD_MS);
+}
+
+static ssize_t inst_holddown_ms_store(struct kobject *kobj, struct kobj_attribute *attr,
+                                      const char *buf, size_t count)
+{
+    return lfsm_holddown_store(kobj, buf, count, LFSM_HD_MS);
+}
+static struct kobj_attribute inst_holddown_ms_attr =
+    __ATTR(holddown_ms, 0644, inst_holddown_ms_show, inst_holddown_ms_store);
+
+static ssize_t inst_holddown_max_ms_show(struct kobject *kobj, struct kobj_attribute *attr,
+                                         char *buf)
+{
+    return lfsm_holddown_show(kobj, buf, LFSM_HD_MAX_MS);
+}
+
+static ssize_t inst_holddown_max_ms_store(struct kobject *kobj, struct kobj_attribute *attr,
+                                          const char *buf, size_t count)
+{
+    return lfsm_holddown_store(kobj, buf, count, LFSM_HD_MAX_MS);
+}
+static struct kobj_attribute inst_holddown_max_ms_attr =
+    __ATTR(holddown_max_ms, 0644, inst_holddown_max_ms_show, inst_holddown_max_ms_store);
+
+static ssize_t inst_debounced_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    struct lfsm_instance *inst = to_lfsm_instance(kobj);
+    unsigned long flags;
+    u64 debounced;
+
+    lfsm_lock_irqsave(inst, flags);
+    debounced = inst->debounced;
+    spin_unlock_irqrestore(&inst->lock, flags);
+    return sprintf(buf, "%llu\n", debounced);
+}
+static struct kobj_attribute inst_debounced_attr =
+    __ATTR(debounced, 0444, inst_debounced_show, NULL);
+
+static ssize_t inst_holddowns_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    struct lfsm_instance *inst = to_lfsm_instance(kobj);
+    unsigned long flags;
+    u64 holddowns;
+
+    lfsm_lock_irqsave(inst, flags);
+    holddowns = inst->holddowns;
+    spin_unlock_irqrestore(&inst->lock, flags);
+    return sprintf(buf, "%llu\n", holddowns);
+}
+static struct kobj_attribute inst_holddowns_attr =
+    __ATTR(holddowns, 0444, inst_holddowns_show, NULL);
+
+/* One name per line, @parents or the children of @kobj's instance */
+static ssize_t lfsm_deps_show(struct kobject *kobj, bool parents, char *buf)
+{
+    struct lfsm_instance *inst = to_lfsm_instance(kobj);
+    struct lfsm_dep *dep;
+    ssize_t len = 0;
+
+    mutex_lock(&lfsm_deps_lock);
+    if (parents) {
+        list_for_each_entry(dep, &inst->dep_parents, parent_entry)
+            len += scnprintf(buf + len, PAGE_SIZE - len, "%s\n", dep->parent->name);
+    } else {
+        list_for_each_entry(dep, &inst->dep_children, child_entry)
+            len += scnprintf(buf + len, PAGE_SIZE - len, "%s\n", dep->child->name);
+    }
+    mutex_unlock(&lfsm_deps_lock);
+    return len;
+}
+
+static ssize_t inst_parents_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return lfsm_deps_show(kobj, true, buf);
+}
+static struct kobj_attribute inst_parents_attr =
+    __ATTR(parents, 0444, inst_parents_show, NULL);
+
+static ssize_t inst_children_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return lfsm_deps_show(kobj, false, buf);
+}
+static struct kobj_attribute inst_children_attr =
+    __ATTR(children, 0444, inst_children_show, NULL);
+
+static ssize_t inst_dep_waits_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    struct lfsm_instance *inst = to_lfsm_instance(kobj);
+    unsigned long flags;
+    u64 dep_waits;
+
+    lfsm_lock_irqsave(inst, flags);
+    dep_waits = inst->dep_waits;
+    spin_unlock_irqrestore(&inst->lock, flags);
+    return sprintf(buf, "%llu\n", dep_waits);
+}
+static struct kobj_attribute inst_dep_waits_attr =
+    __ATTR(dep_waits, 0444, inst_dep_waits_show, NULL);
+
+static ssize_t inst_elided_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    struct lfsm_instance *inst = to_lfsm_instance(kobj);
+    unsigned long flags;
+    u64 elided;
+
+    lfsm_lock_irqsave(inst, flags);
+    elided = inst->elided;
+    spin_unlock_irqrestore(&inst->lock, flags);
+    return sprintf(buf, "%llu\n", elided);
+}
+static struct kobj_attribute inst_elided_attr = __ATTR(elided, 0444, inst_elided_show, NULL);
+
+static ssize_t inst_queue_depth_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    struct lfsm_instance *inst = to_lfsm_instance(kobj);
+    unsigned long flags;
+    unsigned int depth;
+
+    lfsm_lock_irqsave(inst, flags);
+    depth = kfifo_size(&inst->queue);
+    spin_unlock_irqrestore(&inst->lock, flags);
+    return sprintf(buf, "%u\n", depth);
+}
+
+static ssize_t inst_queue_depth_store(struct kobject *kobj, struct kobj_attribute *attr,
+                                      const char *buf, size_t count)
+{
+    unsigned int val;
+    int ret;
+
+    ret = kstrtouint(buf, 0, &val);
+    if (ret)
+        return ret;
+
+    ret = lfsm_instance_set_queue_depth(to_lfsm_instance(kobj), val);
+    return ret ? ret : count;
+}
+static struct kobj_attribute inst_queue_depth_attr =
+    __ATTR(queue_depth, 0644, inst_queue_depth_show, inst_queue_depth_store);
+
+static ssize_t inst_overflow_policy_show(struct kobject *kobj, struct kobj_attribute *attr,
+                                         char *buf)
+{
+    return sprintf(buf, "%s\n", lfsm_overflow_str[READ_ONCE(to_lfsm_instance(kobj)->overflow_policy)]);
+}
+
+static ssize_t inst_overflow_policy_store(struct kobject *kobj, struct kobj_attribute *attr,
+                                          const char *buf, size_t count)
+{
+    int ret;
+
+    ret = sysfs_match_string(lfsm_overflow_str, buf);
+    if (ret < 0)
+        return ret;
+
+    ret = lfsm_instance_set_overflow_policy(to_lfsm_instance(kobj), ret);
+    return ret ? ret : count;
+}
+static struct kobj_attribute inst_overflow_policy_attr =
+    __ATTR(overflow_policy, 0644, inst_overflow_policy_show, inst_overflow_policy_store);
+
+static ssize_t inst_queue_hwm_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", READ_ONCE(to_lfsm_instance(kobj)->queue_hwm));
+}
+static struct kobj_attribute inst_queue_hwm_attr = __ATTR(queue_hwm, 0444, inst_queue_hwm_show, NULL);
+
+static ssize_t inst_overflows_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    struct lfsm_instance *inst = to_lfsm_instance(kobj);
+    unsigned long flags;
+    u64 overflows;
+
+    lfsm_lock_irqsave(inst, flags);
+    overflows = inst->overflows;
+    spin_unlock_irqrestore(&inst->lock, flags);
+    return sprintf(buf, "%llu\n", overflows);
+}
+static struct kobj_attribute inst_overflows_attr = __ATTR(overflows, 0444, inst_overflows_show, NULL);
+
+static ssize_t inst_lock_contended_show(struct kobject *kobj, struct kobj_attribute *attr,
+                                        char *buf)
+{
+    return sprintf(buf, "%llu\n", lfsm_instance_lock_contended(to_lfsm_instance(kobj)));
+}
+static struct kobj_attribute inst_lock_contended_attr =
+    __ATTR(lock_contended, 0444, inst_lock_contended_show, NULL);
+
+static ssize_t inst_direct_dispatch_show(struct kobject *kobj, struct kobj_attribute *attr,
+                                         char *buf)
+{
+    return sprintf(buf, "%d\n", READ_ONCE(to_lfsm_instance(kobj)->direct_dispatch));
+}
+
+static ssize_t inst_direct_dispatch_store(struct kobject *kobj, struct kobj_attribute *attr,
+                                          const char *buf, size_t count)
+{
+    bool val;
+    int ret;
+
+    ret = kstrtobool(buf, &val);
+    if (ret)
+        return ret;
+
+    lfsm_instance_set_direct_dispatch(to_lfsm_instance(kobj), val);
+    return count;
+}
+static struct kobj_attribute inst_direct_dispatch_attr =
+    __ATTR(direct_dispatch, 0644, inst_direct_dispatch_show, inst_direct_dispatch_store);
+
+static ssize_t inst_highpri_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%d\n", READ_ONCE(to_lfsm_instance(kobj)->highpri));
+}
+
+static ssize_t inst_highpri_store(struct kobject *kobj, struct kobj_attribute *attr,
+                                  const char *buf, size_t count)
+{
+    bool val;
+    int ret;
+
+    ret = kstrtobool(buf, &val);
+    if (ret)
+        return ret;
 
-struct lfsm_action {
-    enum lfsm_action_type type;
-    void *context; /* For future */
-};
+    lfsm_instance_set_highpri(to_lfsm_instance(kobj), val);
+    return count;
+}
+static struct kobj_attribute inst_highpri_attr =
+    __ATTR(highpri, 0644, inst_highpri_show, inst_highpri_store);
 
-DEFINE_KFIFO(lfsm_queue, struct lfsm_action, 16);
-static enum link_state link_lfsm_state = LINK_DOWN;
-static DEFINE_SPINLOCK(lfsm_lock);
+static ssize_t inst_numa_node_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%d\n", READ_ONCE(to_lfsm_instance(kobj)->numa_node));
+}
 
-static struct workqueue_struct *lfsm_wq;
-static struct work_struct lfsm_worker;
-static struct work_struct lfsm_up_work;
-static struct work_struct lfsm_down_work;
-static struct delayed_work lfsm_timeout_work;
-static bool lfsm_work_active = false;
-static struct kobject *lfsm_kobj;
+static ssize_t inst_numa_node_store(struct kobject *kobj, struct kobj_attribute *attr,
+                                    const char *buf, size_t count)
+{
+    int val, ret;
 
-/* Notifier chain */
-static BLOCKING_NOTIFIER_HEAD(link_state_notifier_chain);
+    ret = kstrtoint(buf, 0, &val);
+    if (ret)
+        return ret;
 
-int lfsm_register_link_state_notifier(struct notifier_block *nb) {
-    return blocking_notifier_chain_register(&link_state_notifier_chain, nb);
+    ret = lfsm_instance_set_numa_node(to_lfsm_instance(kobj), val);
+    return ret ? ret : count;
 }
-EXPORT_SYMBOL_GPL(lfsm_register_link_state_notifier);
+static struct kobj_attribute inst_numa_node_attr =
+    __ATTR(numa_node, 0644, inst_numa_node_show, inst_numa_node_store);
 
-int lfsm_unregister_link_state_notifier(struct notifier_block *nb) {
-    return blocking_notifier_chain_unregister(&link_state_notifier_chain, nb);
+/* Hex CPU mask as in /proc/irq/N/smp_affinity; all zeroes means unrestricted */
+static ssize_t inst_cpumask_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    struct lfsm_instance *inst = to_lfsm_instance(kobj);
+    ssize_t len;
+
+    lfsm_lock_irq(inst);
+    len = sprintf(buf, "%*pb\n", cpumask_pr_args(inst->cpumask));
+    spin_unlock_irq(&inst->lock);
+    return len;
 }
-EXPORT_SYMBOL_GPL(lfsm_unregister_link_state_notifier);
 
-/* Generic Netlink Definitions */
-static struct genl_family lfsm_genl_family;
+static ssize_t inst_cpumask_store(struct kobject *kobj, struct kobj_attribute *attr,
+                                  const char *buf, size_t count)
+{
+    cpumask_var_t mask;
+    int ret;
 
-enum {
-    LFSM_ATTR_UNSPEC,
-    LFSM_ATTR_LINK_STATE,
-    __LFSM_ATTR_MAX,
-};
-#define LFSM_ATTR_MAX (__LFSM_ATTR_MAX - 1)
+    if (!alloc_cpumask_var(&mask, GFP_KERNEL))
+        return -ENOMEM;
 
-static struct nla_policy lfsm_nl_policy[LFSM_ATTR_MAX + 1] = {
-    [LFSM_ATTR_LINK_STATE] = { .type = NLA_U32 },
-};
+    ret = cpumask_parse(buf, mask);
+    if (!ret)
+        ret = lfsm_instance_set_cpumask(to_lfsm_instance(kobj), mask);
 
-enum {
-    LFSM_CMD_UNSPEC,
-    LFSM_CMD_NOTIFY,
-    LFSM_CMD_LINK_UP,
-    LFSM_CMD_LINK_DOWN,
-    LFSM_CMD_CANCEL,
-    __LFSM_CMD_MAX,
-};
-#define LFSM_CMD_MAX (__LFSM_CMD_MAX - 1)
+    free_cpumask_var(mask);
+    return ret ? ret : count;
+}
+static struct kobj_attribute inst_cpumask_attr =
+    __ATTR(cpumask, 0644, inst_cpumask_show, inst_cpumask_store);
 
-enum {
-    LFSM_MCGRP_EVENTS,
+static struct attribute *lfsm_inst_attrs[] = {
+    &inst_state_attr.attr,
+    &inst_queue_attr.attr,
+    &inst_id_attr.attr,
+    &inst_delay_ms_attr.attr,
+    &inst_timeout_ms_attr.attr,
+    &inst_coalesce_attr.attr,
+    &inst_elided_attr.attr,
+    &inst_debounce_ms_attr.attr,
+    &inst_holddown_flaps_attr.attr,
+    &inst_holddown_ms_attr.attr,
+    &inst_holddown_max_ms_attr.attr,
+    &inst_debounced_attr.attr,
+    &inst_holddowns_attr.attr,
+    &inst_parents_attr.attr,
+    &inst_children_attr.attr,
+    &inst_dep_waits_attr.attr,
+    &inst_queue_depth_attr.attr,
+    &inst_overflow_policy_attr.attr,
+    &inst_queue_hwm_attr.attr,
+    &inst_overflows_attr.attr,
+    &inst_lock_contended_attr.attr,
+    &inst_direct_dispatch_attr.attr,
+    &inst_highpri_attr.attr,
+    &inst_numa_node_attr.attr,
+    &inst_cpumask_attr.attr,
+    NULL,
 };
+ATTRIBUTE_GROUPS(lfsm_inst);
 
-static const struct genl_multicast_group lfsm_mcgrps[] = {
-    [LFSM_MCGRP_EVENTS] = { .name = "lfsm_events" },
+static void lfsm_instance_release(struct kobject *kobj)
+{
+    struct lfsm_instance *inst = to_lfsm_instance(kobj);
+
+    sysfs_put(inst->state_kn);
+    ida_free(&lfsm_ida, inst->id);
+    kfifo_free(&inst->queue);
+    free_cpumask_var(inst->cpumask);
+    kfree(inst);
+}
+
+static const struct kobj_type lfsm_inst_ktype = {
+    .release = lfsm_instance_release,
+    .sysfs_ops = &kobj_sysfs_ops,
+    .default_groups = lfsm_inst_groups,
 };
 
-static void lfsm_notify_state(enum link_state state) {
-    struct sk_buff *skb;
-    void *msg_head;
+// --- debugfs ---
 
-    skb = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
-    if (!skb)
-        return;
+/*
+ * lfsm/dump: every instance's queue and history in the packed layout of
+ * lfsm_uapi.h, built once at open() so a collector gets a consistent snapshot
+ * from one or more read()s without any string parsing.
+ */
+static struct dentry *lfsm_debugfs;
 
-    msg_head = genlmsg_put(skb, 0, 0, &lfsm_genl_family, 0, LFSM_CMD_NOTIFY);
-    if (!msg_head)
-        goto free;
+struct lfsm_dump_buf {
+    size_t len;
+    char data[];
+};
 
-    if (nla_put_u32(skb, LFSM_ATTR_LINK_STATE, state))
-        goto free;
+/*
+ * Caller holds lfsm_instances_lock. Appends @inst at @p, with its urgent
+ * actions and as many queued ones as *@left still has room for, peeked
+ * through @scratch, and returns the end.
+ */
+static char *lfsm_dump_instance(struct lfsm_instance *inst, char *p, size_t *left,
+                                unsigned int max_depth, struct lfsm_action *scratch)
+{
+    struct lfsm_dump_instance *di = (struct lfsm_dump_instance *)p;
+    struct lfsm_dump_action *da;
+    struct lfsm_history_record *hr;
+    unsigned int i, n, np;
+    u64 gen, total;
 
-    genlmsg_end(skb, msg_head);
-    genlmsg_multicast(&lfsm_genl_family, skb, 0, LFSM_MCGRP_EVENTS, GFP_KERNEL);
-    return;
-free:
-    nlmsg_free(skb);
-}
+    memset(di, 0, sizeof(*di));
+    di->id = inst->id;
+    memcpy(di->name, inst->name, sizeof(di->name));
 
-static int lfsm_cmd_handler(struct sk_buff *skb, struct genl_info *info) {
-    if (!info)
-        return -EINVAL;
+    lfsm_lock_irq(inst);
+    np = kfifo_out_peek(&inst->prio, scratch, LFSM_PRIO_LEN);
+    n = kfifo_out_peek(&inst->queue, scratch + np, min_t(size_t, *left, max_depth));
+    spin_unlock_irq(&inst->lock);
+    *left -= n;
+    n += np;
+    di->state = lfsm_instance_get_link_state_gen(inst, &gen);
+    di->gen = gen;
+    di->queue_len = n;
 
-    switch (info->genlhdr->cmd) {
-    case LFSM_CMD_LINK_UP:
-        return lfsm_link_up();
-    case LFSM_CMD_LINK_DOWN:
-        return lfsm_link_down();
-    case LFSM_CMD_CANCEL:
-        lfsm_force_down();
-        return 0;
-    default:
-        return -EOPNOTSUPP;
+    da = (struct lfsm_dump_action *)(di + 1);
+    for (i = 0; i < n; i++, da++) {
+        da->enqueue_ns = scratch[i].enqueue_ns;
+        da->type = scratch[i].type;
+        da->flags = (scratch[i].context ? LFSM_DUMP_ACT_WAITED : 0) |
+                    (i < np ? LFSM_DUMP_ACT_URGENT : 0);
     }
+
+    hr = (struct lfsm_history_record *)da;
+    di->history_len = lfsm_history_snapshot(inst, hr, &total);
+    di->history_total = total;
+    return (char *)(hr + di->history_len);
 }
 
-static const struct genl_ops lfsm_genl_ops[] = {
-    {
-        .cmd = LFSM_CMD_LINK_UP,
-        .doit = lfsm_cmd_handler,
-        .policy = lfsm_nl_policy,
-        .flags = GENL_ADMIN_PERM,
-    },
-    {
-        .cmd = LFSM_CMD_LINK_DOWN,
-        .doit = lfsm_cmd_handler,
-        .policy = lfsm_nl_policy,
-        .flags = GENL_ADMIN_PERM,
-    },
-    {
-        .cmd = LFSM_CMD_CANCEL,
-        .doit = lfsm_cmd_handler,
-        .policy = lfsm_nl_policy,
-        .flags = GENL_ADMIN_PERM,
+static int lfsm_dump_open(struct inode *inode, struct file *file)
+{
+    struct lfsm_dump_header *hdr;
+    struct lfsm_instance *inst;
+    struct lfsm_action *scratch;
+    struct lfsm_dump_buf *buf;
+    unsigned int n = 0, depth, max_depth = 0;
+    size_t size = sizeof(*hdr), left = 0;
+    char *p;
+
+    mutex_lock(&lfsm_instances_lock);
+    list_for_each_entry(inst, &lfsm_instances, node) {
+        lfsm_lock_irq(inst);
+        depth = kfifo_size(&inst->queue);
+        spin_unlock_irq(&inst->lock);
+
+        size += sizeof(struct lfsm_dump_instance) +
+                LFSM_HISTORY_LEN * sizeof(struct lfsm_history_record);
+        left += depth;
+        max_depth = max(max_depth, depth);
+        n++;
     }
-};
+    size += (left + (size_t)n * LFSM_PRIO_LEN) * sizeof(struct lfsm_dump_action);
 
-static struct genl_family lfsm_genl_family = {
-    .name = "lfsm_notify",
-    .version = 1,
-    .maxattr = LFSM_ATTR_MAX,
-    .module = THIS_MODULE,
-    .ops = lfsm_genl_ops,
-    .n_ops = ARRAY_SIZE(lfsm_genl_ops),
-    .mcgrps = lfsm_mcgrps,
-    .n_mcgrps = ARRAY_SIZE(lfsm_mcgrps),
-};
+    buf = kvmalloc(struct_size(buf, data, size), GFP_KERNEL);
+    scratch = kvmalloc_array(LFSM_PRIO_LEN + max_depth, sizeof(*scratch), GFP_KERNEL);
+    if (!buf || !scratch) {
+        mutex_unlock(&lfsm_instances_lock);
+        kvfree(scratch);
+        kvfree(buf);
+        return -ENOMEM;
+    }
 
-static void lfsm_timeout_worker(struct work_struct *work)
-{
-    spin_lock(&lfsm_lock);
-    pr_warn("LFSM: Transition timed out. Forcing link DOWN\n");
+    hdr = (struct lfsm_dump_header *)buf->data;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = LFSM_DUMP_MAGIC;
+    hdr->version = LFSM_DUMP_VERSION;
+    hdr->n_instances = n;
+    hdr->header_size = sizeof(*hdr);
+    hdr->instance_size = sizeof(struct lfsm_dump_instance);
+    hdr->action_size = sizeof(struct lfsm_dump_action);
+    hdr->history_size = sizeof(struct lfsm_history_record);
+    hdr->timestamp_ns = ktime_get_ns();
 
-    cancel_work_sync(&lfsm_up_work);
-    cancel_work_sync(&lfsm_down_work);
-    kfifo_reset(&lfsm_queue);
+    /* A queue grown since it was sized above is truncated to what is left */
+    p = (char *)(hdr + 1);
+    list_for_each_entry(inst, &lfsm_instances, node)
+        p = lfsm_dump_instance(inst, p, &left, max_depth, scratch);
+    mutex_unlock(&lfsm_instances_lock);
 
-    link_lfsm_state = LINK_DOWN;
-    lfsm_work_active = false;
-    spin_unlock(&lfsm_lock);
+    kvfree(scratch);
+    buf->len = p - buf->data;
+    file->private_data = buf;
+    return 0;
 }
 
-// --- Transition Workers ---
-static void lfsm_up_worker(struct work_struct *work)
+static ssize_t lfsm_dump_read(struct file *file, char __user *ubuf, size_t count,
+                              loff_t *ppos)
 {
-    msleep(LFSM_DELAY_MS);
+    struct lfsm_dump_buf *buf = file->private_data;
 
-    spin_lock(&lfsm_lock);
-    cancel_delayed_work_sync(&lfsm_timeout_work);
-    link_lfsm_state = LINK_UP;
-    pr_info("LFSM: Link is UP\n");
-    queue_work(lfsm_wq, &lfsm_worker);
-    spin_unlock(&lfsm_lock);
-
-    lfsm_notify_state(LINK_UP);
-    blocking_notifier_call_chain(&link_state_notifier_chain, LINK_UP, NULL);
+    return simple_read_from_buffer(ubuf, count, ppos, buf->data, buf->len);
 }
 
-static void lfsm_down_worker(struct work_struct *work)
+static int lfsm_dump_release(struct inode *inode, struct file *file)
 {
-    msleep(LFSM_DELAY_MS);
+    kvfree(file->private_data);
+    return 0;
+}
 
-    spin_lock(&lfsm_lock);
-    cancel_delayed_work_sync(&lfsm_timeout_work);
-    link_lfsm_state = LINK_DOWN;
-    pr_info("LFSM: Link is DOWN\n");
-    queue_work(lfsm_wq, &lfsm_worker);
-    spin_unlock(&lfsm_lock);
+static const struct file_operations lfsm_dump_fops = {
+    .owner = THIS_MODULE,
+    .open = lfsm_dump_open,
+    .read = lfsm_dump_read,
+    .release = lfsm_dump_release,
+    .llseek = default_llseek,
+};
 
-    lfsm_notify_state(LINK_DOWN);
-    blocking_notifier_call_chain(&link_state_notifier_chain, LINK_DOWN, NULL);
-}
+// --- State Device ---
 
-// --- LFSM Dispatcher ---
-static void lfsm_dispatch_worker(struct work_struct *work)
+static int lfsm_shm_mmap(struct file *file, struct vm_area_struct *vma)
 {
-    struct lfsm_action act;
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+    vm_flags_clear(vma, VM_MAYWRITE);
+    return remap_vmalloc_range(vma, lfsm_shm, vma->vm_pgoff);
+}
 
-    spin_lock(&lfsm_lock);
-    if (!kfifo_out(&lfsm_queue, &act, 1)) {
-        lfsm_work_active = false;
-        spin_unlock(&lfsm_lock);
-        return;
-    }
+static const struct file_operations lfsm_shm_fops = {
+    .owner = THIS_MODULE,
+    .mmap = lfsm_shm_mmap,
+};
 
-    switch (act.type) {
-    case LFSM_ACT_LINK_UP:
-        link_lfsm_state = LINK_STARTING;
-        queue_delayed_work(lfsm_wq, &lfsm_timeout_work, msecs_to_jiffies(LFSM_TIMEOUT_MS));
-        queue_work(lfsm_wq, &lfsm_up_work);
-        break;
+static struct miscdevice lfsm_shm_dev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = "lfsm_state",
+    .fops = &lfsm_shm_fops,
+    .mode = 0444,
+};
 
-    case LFSM_ACT_LINK_DOWN:
-        link_lfsm_state = LINK_STOPPING;
-        queue_delayed_work(lfsm_wq, &lfsm_timeout_work, msecs_to_jiffies(LFSM_TIMEOUT_MS));
-        queue_work(lfsm_wq, &lfsm_down_work);
-        break;
+static int lfsm_shm_alloc(void)
+{
+    struct lfsm_shm_header *hdr;
 
-    default:
-        pr_warn("LFSM: Unknown action type %d\n", act.type);
-        lfsm_work_active = false;
-        break;
-    }
+    lfsm_shm = vmalloc_user(LFSM_SHM_SIZE);
+    if (!lfsm_shm)
+        return -ENOMEM;
 
-    spin_unlock(&lfsm_lock);
+    hdr = lfsm_shm;
+    hdr->magic = LFSM_SHM_MAGIC;
+    hdr->version = LFSM_SHM_VERSION;
+    hdr->slot_size = sizeof(struct lfsm_state_slot);
+    hdr->n_slots = LFSM_SHM_SLOTS;
+    return 0;
 }
 
-// --- Public Link LFSM Wrapper API ---
+// --- Instance lifetime ---
 
-static int enqueue_lfsm_action(enum lfsm_action_type type)
+/*
+ * Caller holds lfsm_instances_lock. Makes @inst's share of the request pool
+ * @n handles. A pool that cannot grow only leaves a smaller reserve.
+ */
+static void lfsm_request_pool_grow(struct lfsm_instance *inst, unsigned int n)
 {
-    struct lfsm_action act = { .type = type, .context = NULL };
-    unsigned long flags;
-    int ret = 0;
-
-    spin_lock_irqsave(&lfsm_lock, flags);
-    if (!kfifo_in(&lfsm_queue, &act, 1)) {
-        ret = -ENOSPC;
-        goto out;
-    }
+    int size = lfsm_request_pool_size - inst->request_reserve + n;
 
-    if (!lfsm_work_active) {
-        lfsm_work_active = true;
-        queue_work(lfsm_wq, &lfsm_worker);
+    lockdep_assert_held(&lfsm_instances_lock);
+    if (mempool_resize(lfsm_request_pool, size)) {
+        pr_warn("LFSM: %s: Cannot reserve %u request handles\n", inst->name, n);
+        return;
     }
-
-    pr_info("LFSM: Queued action: %s\n", lfsm_action_str[type]);
-out:
-    spin_unlock_irqrestore(&lfsm_lock, flags);
-    return ret;
+    lfsm_request_pool_size = size;
+    inst->request_reserve = n;
 }
 
 /**
- * lfsm_link_up - Establishes a link or connection.
+ * lfsm_instance_create_table - Creates a state machine from a table.
+ * @name: Unique name, also used for /sys/kernel/lfsm/<name>/.
+ * @table: Transition table, see struct lfsm_table.
+ * @ops: Driver transition hooks, or NULL for fixed-delay transitions.
+ * @priv: Opaque pointer handed back to @ops.
  *
- * This function is responsible for initializing or bringing up a link.
- * The specific behavior depends on the implementation details within
- * the function body.
+ * As lfsm_instance_create(), for state machines beyond the four link
+ * states. @table is validated here, once; dispatching a trigger afterwards
+ * costs a single lookup in it. The instance starts in @table's initial state,
+ * unless a checkpoint sent with the RESTORE netlink command is waiting for
+ * @name, in which case it resumes from that before this returns.
  *
- * Return: 0 on success, negative error code on failure.
+ * Context: Process context, may sleep.
+ * Return: The new instance, or an ERR_PTR() on failure, -EINVAL for a
+ * table lfsm_table_validate() refuses.
  */
-int lfsm_link_up(void)
+struct lfsm_instance *lfsm_instance_create_table(const char *name,
+                                                 const struct lfsm_table *table,
+                                                 const struct lfsm_ops *ops, void *priv)
 {
-    unsigned long flags;
+    struct lfsm_instance *inst, *it;
     int ret;
 
-    spin_lock_irqsave(&lfsm_lock, flags);
-    if (link_lfsm_state == LINK_DOWN)
-        ret = enqueue_lfsm_action(LFSM_ACT_LINK_UP);
-    else if (link_lfsm_state == LINK_UP)
-        ret = 0;
-    else
-        ret = -EBUSY;
-    spin_unlock_irqrestore(&lfsm_lock, flags);
-    return ret;
+    if (!name || !*name || strlen(name) >= LFSM_NAME_LEN || strchr(name, '/'))
+        return ERR_PTR(-EINVAL);
+    ret = lfsm_table_validate(table);
+    if (ret)
+        return ERR_PTR(ret);
+
+    inst = kzalloc(sizeof(*inst), GFP_KERNEL);
+    if (!inst)
+        return ERR_PTR(-ENOMEM);
+
+    ret = kfifo_alloc(&inst->queue,
+                      clamp_t(unsigned int, READ_ONCE(lfsm_queue_depth), 2, LFSM_QUEUE_MAX),
+                      GFP_KERNEL);
+    if (ret) {
+        kfree(inst);
+        return ERR_PTR(ret);
+    }
+    if (!zalloc_cpumask_var(&inst->cpumask, GFP_KERNEL)) {
+        kfifo_free(&inst->queue);
+        kfree(inst);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    strscpy(inst->name, name, sizeof(inst->name));
+    spin_lock_init(&inst->lock);
+    INIT_LIST_HEAD(&inst->waiters);
+    INIT_LIST_HEAD(&inst->dep_parents);
+    INIT_LIST_HEAD(&inst->dep_children);
+    INIT_KFIFO(inst->prio);
+    atomic64_set(&inst->state_gen, table->initial);
+    inst->table = table;
+    inst->ops = ops ? ops : &lfsm_delay_ops;
+    inst->priv = priv;
+    inst->delay_ms = READ_ONCE(lfsm_delay_ms);
+    inst->timeout_ms = READ_ONCE(lfsm_timeout_ms) ?: LFSM_TIMEOUT_MS;
+    inst->coalesce = READ_ONCE(lfsm_coalesce);
+    inst->direct_dispatch = READ_ONCE(lfsm_direct_dispatch);
+    inst->overflow_policy = min_t(unsigned int, READ_ONCE(lfsm_overflow_policy),
+                                  LFSM_OVERFLOW_MAX - 1);
+    inst->numa_node = NUMA_NO_NODE;
+    inst->holddown_ms = LFSM_HOLDDOWN_MS;
+    inst->holddown_max_ms = LFSM_HOLDDOWN_MAX_MS;
+    inst->holddown_cur_ms = LFSM_HOLDDOWN_MS;
+    inst->last_req_type = LFSM_ACT_MAX;
+    inst->held_type = LFSM_ACT_MAX;
+    hrtimer_setup(&inst->hold_timer, lfsm_hold_timer_fn, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    INIT_WORK(&inst->worker, lfsm_dispatch_worker);
+    INIT_WORK(&inst->dep_work, lfsm_dep_worker);
+    INIT_WORK(&inst->complete_work, lfsm_complete_worker);
+    INIT_DELAYED_WORK(&inst->delay_work, lfsm_delay_worker);
+    timerqueue_init(&inst->timeout_node);
+    inst->timeout_cpu = -1;
+
+    mutex_lock(&lfsm_instances_lock);
+    list_for_each_entry(it, &lfsm_instances, node) {
+        if (!strcmp(it->name, name)) {
+            ret = -EEXIST;
+            goto free;
+        }
+    }
+
+    ret = ida_alloc(&lfsm_ida, GFP_KERNEL);
+    if (ret < 0)
+        goto free;
+    inst->id = ret;
+    ret = xa_err(xa_store(&lfsm_instances_xa, inst->id, inst, GFP_KERNEL));
+    if (ret) {
+        ida_free(&lfsm_ida, inst->id);
+        goto free;
+    }
+
+    ret = kobject_init_and_add(&inst->kobj, &lfsm_inst_ktype, lfsm_kobj, "%s", name);
+    if (ret) {
+        xa_erase(&lfsm_instances_xa, inst->id);
+        /* release() frees the id and the instance */
+        kobject_put(&inst->kobj);
+        mutex_unlock(&lfsm_instances_lock);
+        return ERR_PTR(ret);
+    }
+    inst->state_kn = sysfs_get_dirent(inst->kobj.sd, "state");
+
+    list_add_tail(&inst->node, &lfsm_instances);
+    lfsm_request_pool_grow(inst, READ_ONCE(lfsm_request_reserve));
+    mutex_unlock(&lfsm_instances_lock);
+
+    lfsm_lock_irq(inst);
+    lfsm_shm_publish(inst, true);
+    spin_unlock_irq(&inst->lock);
+
+    pr_info("LFSM: Created instance %s (id %u)\n", inst->name, inst->id);
+    lfsm_restore_staged(inst);
+    return inst;
+
+free:
+    mutex_unlock(&lfsm_instances_lock);
+    free_cpumask_var(inst->cpumask);
+    kfifo_free(&inst->queue);
+    kfree(inst);
+    return ERR_PTR(ret);
 }
-EXPORT_SYMBOL_GPL(lfsm_link_up);
+EXPORT_SYMBOL_GPL(lfsm_instance_create_table);
 
 /**
- * lfsm_link_down - Handles the event when a link goes down.
+ * lfsm_instance_create - Creates a new link state machine.
+ * @name: Unique name, also used for /sys/kernel/lfsm/<name>/.
+ * @ops: Driver transition hooks, or NULL for fixed-delay transitions.
+ * @priv: Opaque pointer handed back to @ops.
  *
- * This function is called to perform necessary operations when the link
- * status changes to down. It may include cleanup, resource deallocation,
- * or notifying other subsystems about the link status change.
+ * The new instance starts in LINK_DOWN with an empty action queue and
+ * runs its transitions independently of every other instance.
  *
- * Return: 0 on success, negative error code on failure.
+ * Context: Process context, may sleep.
+ * Return: The new instance, or an ERR_PTR() on failure.
  */
-int lfsm_link_down(void)
+struct lfsm_instance *lfsm_instance_create(const char *name, const struct lfsm_ops *ops,
+                                           void *priv)
 {
-    unsigned long flags;
-    int ret;
-
-    spin_lock_irqsave(&lfsm_lock, flags);
-    if (link_lfsm_state == LINK_UP) {
-        ret = enqueue_lfsm_action(LFSM_ACT_LINK_DOWN);
-    } else if (link_lfsm_state == LINK_DOWN) {
-        ret = 0;
-    } else {
-        ret = -EBUSY;
-    }
-    spin_unlock_irqrestore(&lfsm_lock, flags);
-    return ret;
+    return lfsm_instance_create_table(name, &lfsm_link_table, ops, priv);
 }
-EXPORT_SYMBOL_GPL(lfsm_link_down);
+EXPORT_SYMBOL_GPL(lfsm_instance_create);
 
 /**
- * lfsm_get_link_state - Retrieve the current state of the link.
+ * lfsm_instance_destroy - Tears down a link state machine.
+ * @inst: Instance returned by lfsm_instance_create().
  *
- * This function returns the current state of the link as an enum link_state value.
+ * Unpublishes @inst, drops its dependencies, cancels any in-flight
+ * transition and frees it once the last sysfs reference is dropped. @inst
+ * must not be used afterwards.
  *
- * Return: The current link state.
+ * Context: Process context, may sleep.
  */
-enum link_state lfsm_get_link_state(void)
+void lfsm_instance_destroy(struct lfsm_instance *inst)
 {
-    unsigned long flags;
-    enum link_state st;
+    if (IS_ERR_OR_NULL(inst))
+        return;
+
+    might_sleep();
+    mutex_lock(&lfsm_instances_lock);
+    list_del(&inst->node);
+    xa_erase(&lfsm_instances_xa, inst->id);
+    lfsm_request_pool_grow(inst, 0);
+    mutex_unlock(&lfsm_instances_lock);
 
-    spin_lock_irqsave(&lfsm_lock, flags);
-    st = link_lfsm_state;
-    spin_unlock_irqrestore(&lfsm_lock, flags);
+    /* No request may queue work once force_down has cancelled it */
+    lfsm_lock_irq(inst);
+    inst->dead = true;
+    spin_unlock_irq(&inst->lock);
 
-    return st;
+    lfsm_dep_unlink_all(inst);
+    lfsm_instance_force_down(inst);
+    lfsm_lock_irq(inst);
+    lfsm_shm_publish(inst, false);
+    spin_unlock_irq(&inst->lock);
+    /* Subscriber calls for the final cancel event still use @inst */
+    flush_workqueue(lfsm_notify_wq);
+    kobject_del(&inst->kobj);
+    kobject_put(&inst->kobj);
 }
-EXPORT_SYMBOL_GPL(lfsm_get_link_state);
+EXPORT_SYMBOL_GPL(lfsm_instance_destroy);
 
-/**
- * lfsm_force_down - Forcefully shuts down the LFSM subsystem.
- *
- * This function initiates a forced shutdown of the lfsm subsystem. It 
- * is typically used in scenarios where a graceful shutdown is not possible
- * or when an emergency stop is required to prevent further operations.
- *
- * Context: May be called in critical error handling paths.
- */
-void lfsm_force_down(void)
+const char *lfsm_instance_name(const struct lfsm_instance *inst)
 {
-    cancel_work_sync(&lfsm_worker);
-    cancel_work_sync(&lfsm_up_work);
-    cancel_work_sync(&lfsm_down_work);
-    cancel_delayed_work_sync(&lfsm_timeout_work);
+    return inst->name;
+}
+EXPORT_SYMBOL_GPL(lfsm_instance_name);
 
-    spin_lock(&lfsm_lock);
-    kfifo_reset(&lfsm_queue);
-    link_lfsm_state = LINK_DOWN;
-    lfsm_work_active = false;
-    pr_info("LFSM: Cancelled all and forced link DOWN\n");
-    spin_unlock(&lfsm_lock);
+u32 lfsm_instance_id(const struct lfsm_instance *inst)
+{
+    return inst->id;
 }
-EXPORT_SYMBOL_GPL(lfsm_force_down);
+EXPORT_SYMBOL_GPL(lfsm_instance_id);
 
-// --- sysfs ---
-static ssize_t state_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+void *lfsm_instance_priv(const struct lfsm_instance *inst)
 {
-    enum link_state s = lfsm_get_link_state();
-    return sprintf(buf, "%s\n", (s < LINK_STATE_MAX) ? link_state_str[s] : "UNKNOWN");
+    return inst->priv;
 }
-static struct kobj_attribute state_attr = __ATTR_RO(state);
+EXPORT_SYMBOL_GPL(lfsm_instance_priv);
 
-static ssize_t queue_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+// --- Init / Cleanup ---
+static void lfsm_destroy_workqueues(void)
 {
-    struct lfsm_action q[16];
-    ssize_t len = 0;
-    int i, n;
-    unsigned long flags;
+    int i;
 
-    spin_lock_irqsave(&lfsm_lock, flags);
-    n = kfifo_out_peek(&lfsm_queue, q, ARRAY_SIZE(q));
-    for (i = 0; i < n; i++) {
-        if (q[i].type < LFSM_ACT_MAX)
-            len += scnprintf(buf + len, PAGE_SIZE - len, "%s\n", lfsm_action_str[q[i].type]);
+    for (i = 0; i < LFSM_WQ_MAX; i++) {
+        if (lfsm_wqs[i])
+            destroy_workqueue(lfsm_wqs[i]);
+        lfsm_wqs[i] = NULL;
     }
-    spin_unlock_irqrestore(&lfsm_lock, flags);
-    return len;
 }
-static struct kobj_attribute queue_attr = __ATTR_RO(queue);
 
-static struct attribute *lfsm_attrs[] = {
-    &state_attr.attr,
-    &queue_attr.attr,
-    NULL,
-};
+static int lfsm_alloc_workqueues(void)
+{
+    int i;
 
-static struct attribute_group lfsm_attr_group = {
-    .attrs = lfsm_attrs,
-};
+    for (i = 0; i < LFSM_WQ_MAX; i++) {
+        lfsm_wqs[i] = alloc_workqueue("%s", lfsm_wq_defs[i].flags, 0, lfsm_wq_defs[i].name);
+        if (!lfsm_wqs[i])
+            return -ENOMEM;
+    }
+    return 0;
+}
+
+/* The user-space layouts of lfsm_uapi.h must not move under any ABI */
+static void __init lfsm_check_uapi(void)
+{
+    BUILD_BUG_ON(sizeof(struct lfsm_shm_header) != 64);
+    BUILD_BUG_ON(sizeof(struct lfsm_state_slot) != 32 + LFSM_NAME_LEN);
+    BUILD_BUG_ON(offsetof(struct lfsm_state_slot, state) != 12);
+    BUILD_BUG_ON(offsetof(struct lfsm_state_slot, gen) != 16);
+    BUILD_BUG_ON(offsetof(struct lfsm_state_slot, timestamp_ns) != 24);
+    BUILD_BUG_ON(offsetof(struct lfsm_state_slot, name) != 32);
+
+    BUILD_BUG_ON(sizeof(struct lfsm_event_record) != 40);
+    BUILD_BUG_ON(offsetof(struct lfsm_event_record, lost) != 16);
+    BUILD_BUG_ON(offsetof(struct lfsm_event_record, id) != 24);
+    BUILD_BUG_ON(offsetof(struct lfsm_event_record, new_state) != 32);
+    BUILD_BUG_ON(offsetof(struct lfsm_event_record, cause) != 36);
+    BUILD_BUG_ON(offsetof(struct lfsm_event_record, flags) != 38);
+
+    BUILD_BUG_ON(sizeof(struct lfsm_dump_header) != 32);
+    BUILD_BUG_ON(offsetof(struct lfsm_dump_header, header_size) != 12);
+    BUILD_BUG_ON(offsetof(struct lfsm_dump_header, timestamp_ns) != 24);
+    BUILD_BUG_ON(sizeof(struct lfsm_dump_instance) != 32 + LFSM_NAME_LEN);
+    BUILD_BUG_ON(offsetof(struct lfsm_dump_instance, gen) != 8);
+    BUILD_BUG_ON(offsetof(struct lfsm_dump_instance, history_total) != 24);
+    BUILD_BUG_ON(offsetof(struct lfsm_dump_instance, name) != 32);
+    BUILD_BUG_ON(sizeof(struct lfsm_dump_action) != 16);
+    BUILD_BUG_ON(offsetof(struct lfsm_dump_action, type) != 8);
+    BUILD_BUG_ON(sizeof(struct lfsm_history_record) != 40);
+    BUILD_BUG_ON(offsetof(struct lfsm_history_record, old_state) != 24);
+    BUILD_BUG_ON(offsetof(struct lfsm_history_record, reserved) != 36);
+
+    /* Slots are mapped back to back after the header */
+    BUILD_BUG_ON(sizeof(struct lfsm_shm_header) % __alignof__(struct lfsm_state_slot));
+}
 
-// --- Init / Cleanup ---
 static int __init lfsm_module_init(void)
 {
     int ret;
 
-    spin_lock_init(&lfsm_lock);
-    INIT_WORK(&lfsm_worker, lfsm_dispatch_worker);
-    INIT_WORK(&lfsm_up_work, lfsm_up_worker);
-    INIT_WORK(&lfsm_down_work, lfsm_down_worker);
-    INIT_DELAYED_WORK(&lfsm_timeout_work, lfsm_timeout_worker);
+    lfsm_check_uapi();
+    lfsm_timeout_init();
 
-    lfsm_wq = alloc_workqueue("lfsm_wq", WQ_UNBOUND, 0);
-    if (!lfsm_wq)
+    lfsm_request_cache = KMEM_CACHE(lfsm_request, 0);
+    if (!lfsm_request_cache)
+        return -ENOMEM;
+    lfsm_request_pool = mempool_create_slab_pool(LFSM_REQUEST_POOL_MIN, lfsm_request_cache);
+    if (!lfsm_request_pool) {
+        kmem_cache_destroy(lfsm_request_cache);
         return -ENOMEM;
+    }
+
+    ret = lfsm_alloc_workqueues();
+    if (ret)
+        goto destroy_wq;
+
+    lfsm_notify_wq = alloc_workqueue("lfsm_notify_wq", WQ_UNBOUND, 0);
+    if (!lfsm_notify_wq) {
+        ret = -ENOMEM;
+        goto destroy_wq;
+    }
+
+    /* Before any instance exists, as every instance has a slot */
+    ret = lfsm_shm_alloc();
+    if (ret)
+        goto destroy_notify_wq;
 
     lfsm_kobj = kobject_create_and_add("lfsm", kernel_kobj);
     if (!lfsm_kobj) {
         ret = -ENOMEM;
-        goto destroy_wq;
+        goto free_shm;
     }
 
     ret = sysfs_create_group(lfsm_kobj, &lfsm_attr_group);
     if (ret) {
         goto out;
     }
+    lfsm_state_kn = sysfs_get_dirent(lfsm_kobj->sd, "state");
 
-    pr_info("LFSM: Module loaded with generic action support.\n");
+    lfsm_default = lfsm_instance_create(LFSM_DEFAULT_INSTANCE, NULL, NULL);
+    if (IS_ERR(lfsm_default)) {
+        ret = PTR_ERR(lfsm_default);
+        goto remove_group;
+    }
 
-    return ret;
+    skb_queue_head_init(&lfsm_notify_pool);
+    lfsm_notify_pool_refill(NULL);
 
-destroy_wq:
-    destroy_workqueue(lfsm_wq);
+    ret = genl_register_family(&lfsm_genl_family);
+    if (ret) {
+        pr_err("LFSM: Failed to register netlink family: %d\n", ret);
+        goto purge_pool;
+    }
+    WRITE_ONCE(lfsm_nl_registered, true);
+    netlink_register_notifier(&lfsm_nl_notifier);
+
+    ret = misc_register(&lfsm_shm_dev);
+    if (ret) {
+        pr_err("LFSM: Failed to register state device: %d\n", ret);
+        goto unregister_genl;
+    }
+
+    ret = misc_register(&lfsm_evdev);
+    if (ret) {
+        pr_err("LFSM: Failed to register event device: %d\n", ret);
+        goto deregister_shm;
+    }
+
+    /* Optional, so failures are not fatal */
+    lfsm_debugfs = debugfs_create_dir("lfsm", NULL);
+    debugfs_create_file("dump", 0400, lfsm_debugfs, NULL, &lfsm_dump_fops);
+
+    pr_info("LFSM: Module loaded with generic action support.\n");
 
+    return 0;
+
+deregister_shm:
+    misc_deregister(&lfsm_shm_dev);
+unregister_genl:
+    WRITE_ONCE(lfsm_nl_registered, false);
+    genl_unregister_family(&lfsm_genl_family);
+    netlink_unregister_notifier(&lfsm_nl_notifier);
+    lfsm_nl_filters_free();
+    lfsm_restore_free_all();
+    cancel_work_sync(&lfsm_notify_pool_work);
+purge_pool:
+    skb_queue_purge(&lfsm_notify_pool);
+    /* Same order as lfsm_module_exit(): the top-level files use lfsm_default */
+    sysfs_remove_group(lfsm_kobj, &lfsm_attr_group);
+    lfsm_instance_destroy(lfsm_default);
+    goto out;
+remove_group:
+    sysfs_remove_group(lfsm_kobj, &lfsm_attr_group);
 out:
-    destroy_workqueue(lfsm_wq);
+    sysfs_put(lfsm_state_kn);
     kobject_put(lfsm_kobj);
+free_shm:
+    vfree(lfsm_shm);
+destroy_notify_wq:
+    destroy_workqueue(lfsm_notify_wq);
+destroy_wq:
+    lfsm_timeout_exit();
+    lfsm_destroy_workqueues();
+    mempool_destroy(lfsm_request_pool);
+    kmem_cache_destroy(lfsm_request_cache);
 
     return ret;
 }
 
 static void __exit lfsm_module_exit(void)
 {
-    lfsm_force_down();
+    debugfs_remove_recursive(lfsm_debugfs);
+    misc_deregister(&lfsm_evdev);
+    /* Readers released just before unload are freed by lfsm_evdev_free_rcu() */
+    rcu_barrier();
+    misc_deregister(&lfsm_shm_dev);
+    WRITE_ONCE(lfsm_nl_registered, false);
+    genl_unregister_family(&lfsm_genl_family);
+    netlink_unregister_notifier(&lfsm_nl_notifier);
+    lfsm_nl_filters_free();
+    lfsm_restore_free_all();
+    cancel_work_sync(&lfsm_notify_pool_work);
+    skb_queue_purge(&lfsm_notify_pool);
     sysfs_remove_group(lfsm_kobj, &lfsm_attr_group);
+    lfsm_instance_destroy(lfsm_default);
+    sysfs_put(lfsm_state_kn);
     kobject_put(lfsm_kobj);
-    destroy_workqueue(lfsm_wq);
+    vfree(lfsm_shm); /* pages still mapped stay alive until unmapped */
+    destroy_workqueue(lfsm_notify_wq);
+    lfsm_timeout_exit();
+    lfsm_destroy_workqueues();
+    mempool_destroy(lfsm_request_pool);
+    kmem_cache_destroy(lfsm_request_cache);
+    ida_destroy(&lfsm_ida);
     pr_info("LFSM: Module unloaded.\n");
 }
 
@@ -1,11 +1,25 @@
 #ifndef LSFM_H
 #define LSFM_H
 
+#include <linux/types.h>
+
+#include "lfsm_uapi.h"
+
 #define LSFM_MODULE_NAME "lsfm"
+/* Defaults, overridable through the delay_ms/timeout_ms module parameters */
 #define LFSM_DELAY_MS 1000
 #define LFSM_TIMEOUT_MS (3 * LFSM_DELAY_MS)
+/* Defaults of the flap hold-down, which is off until holddown_flaps is set */
+#define LFSM_HOLDDOWN_MS 1000
+#define LFSM_HOLDDOWN_MAX_MS 60000
+/* Ancestors a link may have above it, see lfsm_instance_add_dependency() */
+#define LFSM_DEP_MAX_DEPTH 16
+#define LFSM_DEFAULT_INSTANCE "default"
 
 struct notifier_block;
+struct cpumask;
+struct lfsm_instance;
+struct lfsm_request;
 
 /* LFSM States */
 enum link_state {
@@ -23,11 +37,254 @@ enum lfsm_action_type {
     LFSM_ACT_MAX
 };
 
+/*
+ * Inputs of a transition table. UP and DOWN are queued by link_up/link_down,
+ * DONE/FAILED/TIMEOUT end a transitional state, and tables may define their
+ * own triggers from LFSM_TRIG_CUSTOM on, raised with lfsm_instance_trigger().
+ */
+enum lfsm_trigger {
+    LFSM_TRIG_UP = LFSM_ACT_LINK_UP,
+    LFSM_TRIG_DOWN = LFSM_ACT_LINK_DOWN,
+    LFSM_TRIG_DONE,
+    LFSM_TRIG_FAILED,
+    LFSM_TRIG_TIMEOUT,
+    LFSM_TRIG_CUSTOM
+};
+
+/* What entering the next state runs */
+enum lfsm_op {
+    LFSM_OP_INVALID,     /* trigger not accepted in this state */
+    LFSM_OP_NONE,        /* no driver call; a transitional state completes at once */
+    LFSM_OP_START_UP,    /* lfsm_ops.start_up */
+    LFSM_OP_START_DOWN,  /* lfsm_ops.start_down */
+    LFSM_OP_ENTER,       /* lfsm_ops.enter */
+    LFSM_OP_MAX
+};
+
+#define LFSM_TABLE_MAX_STATES 64
+#define LFSM_TABLE_MAX_TRIGGERS 32
+
+/* struct lfsm_state_info.flags */
+#define LFSM_STATE_TRANSITIONAL (1U << 0)  /* left only by DONE/FAILED/TIMEOUT */
+#define LFSM_STATE_LINK_UP      (1U << 1)  /* a stable state that counts as UP */
+
+struct lfsm_state_info {
+    const char *name;
+    unsigned int flags;
+};
+
+/**
+ * struct lfsm_transition - One cell of a transition table.
+ * @next: State entered.
+ * @op: What entering @next runs; LFSM_OP_INVALID (zero) leaves the cell empty.
+ * @timeout_ms: Timeout of a transitional @next, 0 for the instance's timeout_ms.
+ */
+struct lfsm_transition {
+    u8 next;
+    u8 op;
+    u16 timeout_ms;
+};
+
+#define LFSM_GOTO(_next, _op) { .next = (_next), .op = (_op) }
+
+/**
+ * struct lfsm_table - A state machine definition instances are created from.
+ * @name: Used in log messages.
+ * @n_states: Number of rows of @trans, at most LFSM_TABLE_MAX_STATES.
+ * @n_triggers: Number of columns of @trans, at least LFSM_TRIG_CUSTOM and at
+ *              most LFSM_TABLE_MAX_TRIGGERS.
+ * @initial: Stable state new instances start in and force_down returns to.
+ * @states: @n_states state names and flags.
+ * @trigger_names: Names of the custom triggers, or NULL.
+ * @trans: @n_states rows of @n_triggers cells, row-major.
+ *
+ * Tables are checked once by lfsm_instance_create_table() and must stay
+ * valid and unchanged for the lifetime of the instances created from them.
+ * A stable state accepts UP, DOWN and custom triggers; a transitional state
+ * accepts exactly DONE, FAILED and TIMEOUT, each leading to a stable state.
+ */
+struct lfsm_table {
+    const char *name;
+    unsigned int n_states;
+    unsigned int n_triggers;
+    unsigned int initial;
+    const struct lfsm_state_info *states;
+    const char * const *trigger_names;
+    const struct lfsm_transition *trans;
+};
+
+/**
+ * struct lfsm_ops - Driver hooks that carry out link transitions.
+ * @start_up: Begin bringing the link up. Called from process context when
+ *            the instance enters LINK_STARTING. Return 0 once the hardware
+ *            has been kicked and report the result later through
+ *            lfsm_transition_complete() with @gen, or a negative error to
+ *            fail the transition straight away.
+ * @start_down: As @start_up, for LINK_STOPPING.
+ * @enter: As @start_up, for a table cell with LFSM_OP_ENTER; @state is the
+ *         transitional state being entered.
+ * @abort: Called from process context when the transition @gen, whose op
+ *         was called, ended without the driver's report: it timed out, an
+ *         urgent request aborted it, or lfsm_instance_force_down() reset the
+ *         instance. The instance already reports the state it was moved to;
+ *         stop or undo the hardware transition so that the link matches it.
+ *         May run while the start op is still returning.
+ *
+ * @gen is the generation the instance entered the transitional state with,
+ * see lfsm_instance_get_link_state_gen(). It names this one transition, so
+ * a report for one that already ended cannot settle the next. A transition
+ * that ends before its op is called never calls it. A NULL start hook
+ * completes its transition immediately. Without @abort, ending a transition
+ * only changes LFSM's bookkeeping and the driver must bring the hardware
+ * in line with the reported state itself.
+ */
+struct lfsm_ops {
+    int (*start_up)(struct lfsm_instance *inst, void *priv, u64 gen);
+    int (*start_down)(struct lfsm_instance *inst, void *priv, u64 gen);
+    int (*enter)(struct lfsm_instance *inst, void *priv, unsigned int state, u64 gen);
+    void (*abort)(struct lfsm_instance *inst, void *priv, u64 gen);
+};
+
+/* What to do with a new action when the instance's queue is full */
+enum lfsm_overflow_policy {
+    LFSM_OVERFLOW_REJECT,       /* fail the request with -ENOSPC */
+    LFSM_OVERFLOW_DROP_OLDEST,  /* discard the oldest pending action */
+    LFSM_OVERFLOW_COLLAPSE,     /* discard all pending actions, keep the latest */
+    LFSM_OVERFLOW_MAX
+};
+
+/**
+ * struct lfsm_batch_entry - One request of lfsm_link_set_batch().
+ * @inst: Instance to act on.
+ * @target: LINK_UP or LINK_DOWN.
+ * @status: Set to the per-link result, as lfsm_instance_link_up()/_down().
+ */
+struct lfsm_batch_entry {
+    struct lfsm_instance *inst;
+    enum link_state target;
+    int status;
+};
+
+/**
+ * struct lfsm_checkpoint - Saved instance, see lfsm_instance_checkpoint().
+ * @state: State of the instance. One caught in a transition is saved at
+ *         the state its FAILED exit leads to; the transition itself is
+ *         not carried over.
+ * @delay_ms: Fixed transition delay.
+ * @timeout_ms: Transition timeout.
+ * @queue_depth: Action queue slots.
+ * @overflow_policy: Full-queue policy.
+ * @coalesce: Whether actions are coalesced.
+ * @n_actions: Number of @actions.
+ * @n_urgent: How many of the first @actions sat on the priority lane.
+ * @actions: Pending triggers in dispatch order, urgent ones first.
+ */
+struct lfsm_checkpoint {
+    unsigned int state;
+    unsigned int delay_ms;
+    unsigned int timeout_ms;
+    unsigned int queue_depth;
+    enum lfsm_overflow_policy overflow_policy;
+    bool coalesce;
+    unsigned int n_actions;
+    unsigned int n_urgent;
+    unsigned int actions[];
+};
+
+/* Why an instance changed state */
+enum lfsm_cause {
+    LFSM_CAUSE_REQUEST,   /* a queued link_up/link_down ran to completion */
+    LFSM_CAUSE_FAILURE,   /* the driver reported a failed transition */
+    LFSM_CAUSE_TIMEOUT,   /* the transition exceeded timeout_ms */
+    LFSM_CAUSE_CANCEL,    /* lfsm_instance_force_down() */
+    LFSM_CAUSE_PREEMPT,   /* an urgent request aborted the transition */
+    LFSM_CAUSE_RESTORE,   /* lfsm_instance_restore() */
+    LFSM_CAUSE_MAX
+};
+
+/**
+ * struct lfsm_event - A settled state change, as seen by subscribers.
+ * @inst: Instance that changed state.
+ * @old_state: State before the change, usually LINK_STARTING or LINK_STOPPING.
+ * @new_state: LINK_UP or LINK_DOWN.
+ * @cause: Why the change happened.
+ * @timestamp_ns: CLOCK_MONOTONIC time of the change.
+ * @seq: Per-instance event number, starting at 1. A gap means events were
+ *       lost and the subscriber should resynchronise.
+ *
+ * For instances created from their own table, both states are indices into
+ * that table rather than enum link_state values.
+ */
+struct lfsm_event {
+    struct lfsm_instance *inst;
+    enum link_state old_state;
+    enum link_state new_state;
+    enum lfsm_cause cause;
+    u64 timestamp_ns;
+    u64 seq;
+};
+
 int lfsm_register_link_state_notifier(struct notifier_block *nb);
 int lfsm_unregister_link_state_notifier(struct notifier_block *nb);
+int lfsm_register_atomic_link_state_notifier(struct notifier_block *nb);
+int lfsm_unregister_atomic_link_state_notifier(struct notifier_block *nb);
+
+/* Per-link instances */
+struct lfsm_instance *lfsm_instance_create(const char *name, const struct lfsm_ops *ops,
+                                           void *priv);
+struct lfsm_instance *lfsm_instance_create_table(const char *name,
+                                                 const struct lfsm_table *table,
+                                                 const struct lfsm_ops *ops, void *priv);
+int lfsm_table_validate(const struct lfsm_table *table);
+void lfsm_instance_destroy(struct lfsm_instance *inst);
+const char *lfsm_instance_name(const struct lfsm_instance *inst);
+u32 lfsm_instance_id(const struct lfsm_instance *inst);
+void *lfsm_instance_priv(const struct lfsm_instance *inst);
+int lfsm_instance_link_up(struct lfsm_instance *inst);
+int lfsm_instance_link_down(struct lfsm_instance *inst);
+int lfsm_instance_link_up_sync(struct lfsm_instance *inst);
+int lfsm_instance_link_down_sync(struct lfsm_instance *inst);
+int lfsm_instance_trigger(struct lfsm_instance *inst, unsigned int trigger);
+int lfsm_instance_link_up_urgent(struct lfsm_instance *inst);
+int lfsm_instance_link_down_urgent(struct lfsm_instance *inst);
+int lfsm_instance_add_dependency(struct lfsm_instance *child, struct lfsm_instance *parent);
+void lfsm_instance_remove_dependency(struct lfsm_instance *child, struct lfsm_instance *parent);
+const char *lfsm_instance_state_name(const struct lfsm_instance *inst, unsigned int state);
+struct lfsm_request *lfsm_instance_link_up_async(struct lfsm_instance *inst);
+struct lfsm_request *lfsm_instance_link_down_async(struct lfsm_instance *inst);
+int lfsm_instance_link_up_wait(struct lfsm_instance *inst, unsigned int timeout_ms);
+int lfsm_instance_link_down_wait(struct lfsm_instance *inst, unsigned int timeout_ms);
+int lfsm_request_wait(struct lfsm_request *req, unsigned long timeout);
+void lfsm_request_put(struct lfsm_request *req);
+enum link_state lfsm_instance_get_link_state(struct lfsm_instance *inst);
+enum link_state lfsm_instance_get_link_state_gen(struct lfsm_instance *inst, u64 *gen);
+u64 lfsm_instance_lock_contended(struct lfsm_instance *inst);
+void lfsm_instance_force_down(struct lfsm_instance *inst);
+struct lfsm_checkpoint *lfsm_instance_checkpoint(struct lfsm_instance *inst);
+int lfsm_instance_restore(struct lfsm_instance *inst, const struct lfsm_checkpoint *cp);
+void lfsm_instance_set_delay_ms(struct lfsm_instance *inst, unsigned int delay_ms);
+int lfsm_instance_set_timeout_ms(struct lfsm_instance *inst, unsigned int timeout_ms);
+void lfsm_instance_set_debounce_ms(struct lfsm_instance *inst, unsigned int debounce_ms);
+int lfsm_instance_set_holddown(struct lfsm_instance *inst, unsigned int flaps,
+                               unsigned int holddown_ms, unsigned int max_ms);
+void lfsm_instance_set_coalesce(struct lfsm_instance *inst, bool enable);
+int lfsm_instance_set_queue_depth(struct lfsm_instance *inst, unsigned int depth);
+int lfsm_instance_set_overflow_policy(struct lfsm_instance *inst,
+                                      enum lfsm_overflow_policy policy);
+void lfsm_instance_set_direct_dispatch(struct lfsm_instance *inst, bool enable);
+void lfsm_instance_set_highpri(struct lfsm_instance *inst, bool highpri);
+int lfsm_instance_set_numa_node(struct lfsm_instance *inst, int node);
+int lfsm_instance_set_cpumask(struct lfsm_instance *inst, const struct cpumask *mask);
+void lfsm_transition_complete(struct lfsm_instance *inst, u64 gen, int status);
+int lfsm_link_set_batch(struct lfsm_batch_entry *entries, unsigned int n);
+
+/* Default instance */
 int lfsm_link_up(void);
 int lfsm_link_down(void);
+int lfsm_link_up_wait(unsigned int timeout_ms);
+int lfsm_link_down_wait(unsigned int timeout_ms);
 enum link_state lfsm_get_link_state(void);
+enum link_state lfsm_get_link_state_gen(u64 *gen);
 void lfsm_force_down(void);
 
-#endif // LSFM_H
\ No newline at end of file
+#endif // LSFM_H
@@ -0,0 +1,535 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Stress and latency benchmark for LFSM. Loading the module creates a
+ * private instance and starts a run: one kthread per online CPU hammers
+ * it with a mix of link_up/link_down requests, lockless state reads and
+ * force-downs. module_init returns as soon as the threads are started.
+ * The run ends after duration_ms, when 0 is written to the run parameter,
+ * or on rmmod, whichever comes first, and then logs throughput, lock
+ * contention and latency percentiles. Writing 1 to run starts another.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/kthread.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/delay.h>
+#include <linux/atomic.h>
+#include <linux/ktime.h>
+#include <linux/random.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/notifier.h>
+#include <linux/workqueue.h>
+
+#include "lfsm.h"
+
+static unsigned int threads;
+module_param(threads, uint, 0444);
+MODULE_PARM_DESC(threads, "Number of benchmark threads (default: one per online CPU)");
+
+static unsigned int duration_ms = 5000;
+module_param(duration_ms, uint, 0444);
+MODULE_PARM_DESC(duration_ms, "Length of a run (ms), 0 to run until stopped");
+
+static unsigned int delay_ms;
+module_param(delay_ms, uint, 0444);
+MODULE_PARM_DESC(delay_ms, "Transition delay of the benchmark instance (ms)");
+
+static bool coalesce;
+module_param(coalesce, bool, 0444);
+MODULE_PARM_DESC(coalesce, "Enable coalescing on the benchmark instance");
+
+static bool direct_dispatch;
+module_param(direct_dispatch, bool, 0444);
+MODULE_PARM_DESC(direct_dispatch, "Enable direct dispatch on the benchmark instance");
+
+static unsigned int read_pct = 50;
+module_param(read_pct, uint, 0444);
+MODULE_PARM_DESC(read_pct, "Share of operations that read the state (percent)");
+
+static unsigned int cancel_pct = 1;
+module_param(cancel_pct, uint, 0444);
+MODULE_PARM_DESC(cancel_pct, "Share of operations that force the link down (percent)");
+
+static unsigned int wait_every = 64;
+module_param(wait_every, uint, 0444);
+MODULE_PARM_DESC(wait_every, "Every Nth request waits for its transition, 0 for none");
+
+static unsigned int max_samples = 65536;
+module_param(max_samples, uint, 0444);
+MODULE_PARM_DESC(max_samples, "Latency samples kept per thread and kind");
+
+#define LFSM_BENCH_WAIT_MS 1000
+
+enum lfsm_bench_kind {
+    LFSM_BENCH_ENQUEUE,     /* link_up/link_down call */
+    LFSM_BENCH_TRANSITION,  /* call to settled state, via the _wait variants */
+    LFSM_BENCH_READ,        /* lfsm_instance_get_link_state() */
+    LFSM_BENCH_NOTIFY,      /* state change to blocking subscriber call */
+    LFSM_BENCH_DISPATCH,    /* accepted request to driver op call */
+    LFSM_BENCH_MAX
+};
+
+static const char * const lfsm_bench_kind_str[] = {
+    [LFSM_BENCH_ENQUEUE]    = "enqueue",
+    [LFSM_BENCH_TRANSITION] = "transition",
+    [LFSM_BENCH_READ]       = "read",
+    [LFSM_BENCH_NOTIFY]     = "notify",
+    [LFSM_BENCH_DISPATCH]   = "dispatch",
+};
+
+struct lfsm_bench_samples {
+    u64 *ns;
+    unsigned int n;
+};
+
+struct lfsm_bench_thread {
+    struct task_struct *task;
+    struct lfsm_bench_samples s[LFSM_BENCH_MAX]; /* NOTIFY, DISPATCH are unused here */
+    u64 ops;
+    u64 rejected;
+};
+
+static struct lfsm_instance *lfsm_bench_inst;
+static struct lfsm_bench_thread *lfsm_bench_threads;
+static unsigned int lfsm_bench_nthreads;
+
+/* Samples filled from the subscriber and the driver ops, not a thread */
+struct lfsm_bench_shared {
+    u64 *ns;
+    atomic_t n;
+};
+
+static struct lfsm_bench_shared lfsm_bench_notify;
+static struct lfsm_bench_shared lfsm_bench_dispatch;
+
+/*
+ * Time of the oldest accepted request that no driver op has picked up yet,
+ * 0 if none. Coalesced and superseded requests fold into the next dispatch.
+ */
+static atomic64_t lfsm_bench_queued_ns = ATOMIC64_INIT(0);
+
+static void lfsm_bench_record(struct lfsm_bench_samples *s, u64 ns)
+{
+    if (s->n < max_samples)
+        s->ns[s->n++] = ns;
+}
+
+static void lfsm_bench_record_shared(struct lfsm_bench_shared *s, u64 ns)
+{
+    unsigned int i = atomic_inc_return(&s->n) - 1;
+
+    if (i < max_samples)
+        s->ns[i] = ns;
+}
+
+/*
+ * The instance's driver ops: note the dispatch latency, then model the
+ * transition as a delay_ms wait like an instance without ops would. The
+ * wait ends the transition it was armed for; if that one was cancelled
+ * meanwhile, LFSM ignores the completion.
+ */
+static atomic64_t lfsm_bench_done_gen = ATOMIC64_INIT(0);
+
+static void lfsm_bench_done_fn(struct work_struct *work)
+{
+    lfsm_transition_complete(lfsm_bench_inst, atomic64_read(&lfsm_bench_done_gen), 0);
+}
+static DECLARE_DELAYED_WORK(lfsm_bench_done_work, lfsm_bench_done_fn);
+
+static int lfsm_bench_start(struct lfsm_instance *inst, void *priv, u64 gen)
+{
+    u64 queued = atomic64_xchg(&lfsm_bench_queued_ns, 0);
+
+    if (queued)
+        lfsm_bench_record_shared(&lfsm_bench_dispatch, ktime_get_ns() - queued);
+    if (!delay_ms) {
+        lfsm_transition_complete(inst, gen, 0);
+        return 0;
+    }
+    atomic64_set(&lfsm_bench_done_gen, gen);
+    mod_delayed_work(system_wq, &lfsm_bench_done_work, msecs_to_jiffies(delay_ms));
+    return 0;
+}
+
+static const struct lfsm_ops lfsm_bench_ops = {
+    .start_up = lfsm_bench_start,
+    .start_down = lfsm_bench_start,
+};
+
+static int lfsm_bench_notifier(struct notifier_block *nb, unsigned long val, void *data)
+{
+    const struct lfsm_event *ev = data;
+
+    if (ev->inst != lfsm_bench_inst)
+        return NOTIFY_DONE;
+
+    lfsm_bench_record_shared(&lfsm_bench_notify, ktime_get_ns() - ev->timestamp_ns);
+    return NOTIFY_OK;
+}
+
+static struct notifier_block lfsm_bench_nb = {
+    .notifier_call = lfsm_bench_notifier,
+};
+
+static void lfsm_bench_request(struct lfsm_bench_thread *t, bool up, bool wait)
+{
+    u64 start = ktime_get_ns();
+    bool stamped = false;
+    int ret;
+
+    /* Only requests that move the link lead to a dispatch */
+    if (lfsm_instance_get_link_state(lfsm_bench_inst) == (up ? LINK_DOWN : LINK_UP))
+        stamped = !atomic64_cmpxchg(&lfsm_bench_queued_ns, 0, start);
+
+    if (wait) {
+        ret = up ? lfsm_instance_link_up_wait(lfsm_bench_inst, LFSM_BENCH_WAIT_MS) :
+                   lfsm_instance_link_down_wait(lfsm_bench_inst, LFSM_BENCH_WAIT_MS);
+        if (!ret)
+            lfsm_bench_record(&t->s[LFSM_BENCH_TRANSITION], ktime_get_ns() - start);
+    } else if (direct_dispatch) {
+        /* Only the sleepable entry points dispatch inline */
+        ret = up ? lfsm_instance_link_up_sync(lfsm_bench_inst) :
+                   lfsm_instance_link_down_sync(lfsm_bench_inst);
+        lfsm_bench_record(&t->s[LFSM_BENCH_ENQUEUE], ktime_get_ns() - start);
+    } else {
+        ret = up ? lfsm_instance_link_up(lfsm_bench_inst) :
+                   lfsm_instance_link_down(lfsm_bench_inst);
+        lfsm_bench_record(&t->s[LFSM_BENCH_ENQUEUE], ktime_get_ns() - start);
+    }
+
+    if (ret) {
+        t->rejected++;
+        if (stamped)
+            atomic64_cmpxchg(&lfsm_bench_queued_ns, start, 0);
+    }
+}
+
+static int lfsm_bench_thread_fn(void *data)
+{
+    struct lfsm_bench_thread *t = data;
+    unsigned int requests = 0;
+    u64 start;
+    u32 r;
+
+    while (!kthread_should_stop()) {
+        r = get_random_u32() % 100;
+        if (r < read_pct) {
+            start = ktime_get_ns();
+            lfsm_instance_get_link_state(lfsm_bench_inst);
+            lfsm_bench_record(&t->s[LFSM_BENCH_READ], ktime_get_ns() - start);
+        } else if (r < read_pct + cancel_pct) {
+            lfsm_instance_force_down(lfsm_bench_inst);
+        } else {
+            requests++;
+            lfsm_bench_request(t, r & 1, wait_every && !(requests % wait_every));
+        }
+        t->ops++;
+        cond_resched();
+    }
+    return 0;
+}
+
+static int lfsm_bench_cmp_u64(const void *a, const void *b)
+{
+    u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* @ns must be sorted; @permille is 500 for p50, 999 for p99.9 */
+static u64 lfsm_bench_pct(const u64 *ns, unsigned int n, unsigned int permille)
+{
+    return n ? ns[min_t(u64, (u64)n * permille / 1000, n - 1)] : 0;
+}
+
+static void lfsm_bench_report(enum lfsm_bench_kind kind, u64 *ns, unsigned int n)
+{
+    sort(ns, n, sizeof(*ns), lfsm_bench_cmp_u64, NULL);
+    pr_info("lfsm_bench: %s n=%u p50=%llu p99=%llu p999=%llu max=%llu ns\n",
+            lfsm_bench_kind_str[kind], n, lfsm_bench_pct(ns, n, 500),
+            lfsm_bench_pct(ns, n, 990), lfsm_bench_pct(ns, n, 999), n ? ns[n - 1] : 0);
+}
+
+/* Merges every thread's samples of @kind into one sorted report */
+static void lfsm_bench_report_threads(enum lfsm_bench_kind kind)
+{
+    unsigned int i, n = 0;
+    u64 *all;
+
+    for (i = 0; i < lfsm_bench_nthreads; i++)
+        n += lfsm_bench_threads[i].s[kind].n;
+
+    all = kvmalloc_array(max(n, 1U), sizeof(*all), GFP_KERNEL);
+    if (!all) {
+        pr_warn("lfsm_bench: no memory to report %s\n", lfsm_bench_kind_str[kind]);
+        return;
+    }
+
+    n = 0;
+    for (i = 0; i < lfsm_bench_nthreads; i++) {
+        const struct lfsm_bench_samples *s = &lfsm_bench_threads[i].s[kind];
+
+        memcpy(all + n, s->ns, s->n * sizeof(*all));
+        n += s->n;
+    }
+    lfsm_bench_report(kind, all, n);
+    kvfree(all);
+}
+
+static void lfsm_bench_free(void)
+{
+    unsigned int i, k;
+
+    if (lfsm_bench_threads) {
+        for (i = 0; i < lfsm_bench_nthreads; i++)
+            for (k = 0; k < LFSM_BENCH_MAX; k++)
+                kvfree(lfsm_bench_threads[i].s[k].ns);
+        kfree(lfsm_bench_threads);
+        lfsm_bench_threads = NULL;
+    }
+    kvfree(lfsm_bench_notify.ns);
+    lfsm_bench_notify.ns = NULL;
+    kvfree(lfsm_bench_dispatch.ns);
+    lfsm_bench_dispatch.ns = NULL;
+}
+
+static int lfsm_bench_alloc(void)
+{
+    unsigned int i, k;
+
+    lfsm_bench_threads = kcalloc(lfsm_bench_nthreads, sizeof(*lfsm_bench_threads), GFP_KERNEL);
+    lfsm_bench_notify.ns = kvmalloc_array(max_samples, sizeof(u64), GFP_KERNEL);
+    lfsm_bench_dispatch.ns = kvmalloc_array(max_samples, sizeof(u64), GFP_KERNEL);
+    if (!lfsm_bench_threads || !lfsm_bench_notify.ns || !lfsm_bench_dispatch.ns)
+        return -ENOMEM;
+
+    for (i = 0; i < lfsm_bench_nthreads; i++) {
+        for (k = 0; k < LFSM_BENCH_MAX; k++) {
+            if (k == LFSM_BENCH_NOTIFY || k == LFSM_BENCH_DISPATCH)
+                continue;
+            lfsm_bench_threads[i].s[k].ns = kvmalloc_array(max_samples, sizeof(u64),
+                                                           GFP_KERNEL);
+            if (!lfsm_bench_threads[i].s[k].ns)
+                return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+/*
+ * One run at a time, started from module_init or by writing 1 to run and
+ * ended by duration_ms passing, by writing 0 to run, or by rmmod.
+ */
+static DEFINE_MUTEX(lfsm_bench_lock);
+static bool lfsm_bench_running;
+static u64 lfsm_bench_start_ns;
+static u64 lfsm_bench_contended;
+
+static bool run = true;
+
+/* Caller holds lfsm_bench_lock; @started threads have been created */
+static void lfsm_bench_stop_threads(unsigned int started)
+{
+    unsigned int i;
+
+    for (i = 0; i < started; i++)
+        kthread_stop(lfsm_bench_threads[i].task);
+    /* Waits for subscriber calls in flight, so the samples can be sorted */
+    lfsm_unregister_link_state_notifier(&lfsm_bench_nb);
+    /* Parks the instance so no driver op adds dispatch samples behind us */
+    lfsm_instance_force_down(lfsm_bench_inst);
+    cancel_delayed_work_sync(&lfsm_bench_done_work);
+}
+
+/* Caller holds lfsm_bench_lock. Ends the run, if any, and logs its results. */
+static void lfsm_bench_run_stop(void)
+{
+    u64 ops = 0, rejected = 0, contended, elapsed_ns;
+    unsigned int i;
+
+    lockdep_assert_held(&lfsm_bench_lock);
+    if (!lfsm_bench_running)
+        return;
+
+    lfsm_bench_stop_threads(lfsm_bench_nthreads);
+    elapsed_ns = ktime_get_ns() - lfsm_bench_start_ns;
+    contended = lfsm_instance_lock_contended(lfsm_bench_inst) - lfsm_bench_contended;
+    for (i = 0; i < lfsm_bench_nthreads; i++) {
+        ops += lfsm_bench_threads[i].ops;
+        rejected += lfsm_bench_threads[i].rejected;
+    }
+
+    pr_info("lfsm_bench: threads=%u duration_ms=%llu delay_ms=%u coalesce=%d direct_dispatch=%d read_pct=%u cancel_pct=%u\n",
+            lfsm_bench_nthreads, div_u64(elapsed_ns, NSEC_PER_MSEC), delay_ms, coalesce,
+            direct_dispatch, read_pct, cancel_pct);
+    pr_info("lfsm_bench: ops=%llu ops_per_sec=%llu rejected=%llu lock_contended=%llu\n",
+            ops, div64_u64(ops * NSEC_PER_SEC, max_t(u64, elapsed_ns, 1)), rejected, contended);
+    lfsm_bench_report_threads(LFSM_BENCH_ENQUEUE);
+    lfsm_bench_report_threads(LFSM_BENCH_TRANSITION);
+    lfsm_bench_report_threads(LFSM_BENCH_READ);
+    lfsm_bench_report(LFSM_BENCH_NOTIFY, lfsm_bench_notify.ns,
+                      min_t(unsigned int, atomic_read(&lfsm_bench_notify.n), max_samples));
+    lfsm_bench_report(LFSM_BENCH_DISPATCH, lfsm_bench_dispatch.ns,
+                      min_t(unsigned int, atomic_read(&lfsm_bench_dispatch.n), max_samples));
+
+    lfsm_bench_free();
+    lfsm_bench_running = false;
+    run = false;
+}
+
+static void lfsm_bench_stop_fn(struct work_struct *work)
+{
+    mutex_lock(&lfsm_bench_lock);
+    lfsm_bench_run_stop();
+    mutex_unlock(&lfsm_bench_lock);
+}
+static DECLARE_DELAYED_WORK(lfsm_bench_stop_work, lfsm_bench_stop_fn);
+
+/* Caller holds lfsm_bench_lock */
+static int lfsm_bench_run_start(void)
+{
+    unsigned int i, cpu, started = 0;
+    int ret;
+
+    lockdep_assert_held(&lfsm_bench_lock);
+    if (lfsm_bench_running)
+        return -EBUSY;
+
+    ret = lfsm_bench_alloc();
+    if (ret)
+        goto free;
+    atomic_set(&lfsm_bench_notify.n, 0);
+    atomic_set(&lfsm_bench_dispatch.n, 0);
+    atomic64_set(&lfsm_bench_queued_ns, 0);
+
+    lfsm_instance_set_coalesce(lfsm_bench_inst, coalesce);
+    lfsm_instance_set_direct_dispatch(lfsm_bench_inst, direct_dispatch);
+    lfsm_bench_contended = lfsm_instance_lock_contended(lfsm_bench_inst);
+
+    ret = lfsm_register_link_state_notifier(&lfsm_bench_nb);
+    if (ret)
+        goto free;
+
+    cpu = cpumask_first(cpu_online_mask);
+    for (i = 0; i < lfsm_bench_nthreads; i++) {
+        struct task_struct *task;
+
+        task = kthread_create(lfsm_bench_thread_fn, &lfsm_bench_threads[i],
+                              "lfsm_bench/%u", i);
+        if (IS_ERR(task)) {
+            ret = PTR_ERR(task);
+            lfsm_bench_stop_threads(started);
+            goto free;
+        }
+        kthread_bind(task, cpu);
+        lfsm_bench_threads[i].task = task;
+        started++;
+        cpu = cpumask_next(cpu, cpu_online_mask);
+        if (cpu >= nr_cpu_ids)
+            cpu = cpumask_first(cpu_online_mask);
+    }
+
+    lfsm_bench_start_ns = ktime_get_ns();
+    for (i = 0; i < started; i++)
+        wake_up_process(lfsm_bench_threads[i].task);
+    lfsm_bench_running = true;
+    run = true;
+    if (duration_ms)
+        mod_delayed_work(system_wq, &lfsm_bench_stop_work, msecs_to_jiffies(duration_ms));
+    return 0;
+
+free:
+    lfsm_bench_free();
+    return ret;
+}
+
+/*
+ * Without the instance, before module_init or during module_exit, the
+ * value only says whether init starts a run.
+ */
+static int lfsm_bench_run_set(const char *val, const struct kernel_param *kp)
+{
+    bool enable;
+    int ret;
+
+    ret = kstrtobool(val, &enable);
+    if (ret)
+        return ret;
+
+    /* Stopping must not wait for the stop work while holding its lock */
+    if (!enable)
+        cancel_delayed_work_sync(&lfsm_bench_stop_work);
+    mutex_lock(&lfsm_bench_lock);
+    if (!lfsm_bench_inst)
+        run = enable;
+    else if (enable)
+        ret = lfsm_bench_running ? 0 : lfsm_bench_run_start();
+    else
+        lfsm_bench_run_stop();
+    mutex_unlock(&lfsm_bench_lock);
+    return ret;
+}
+
+static const struct kernel_param_ops lfsm_bench_run_ops = {
+    .set = lfsm_bench_run_set,
+    .get = param_get_bool,
+};
+module_param_cb(run, &lfsm_bench_run_ops, &run, 0644);
+MODULE_PARM_DESC(run, "Write 1 to start a run, 0 to end it and log the results (default: run at load)");
+
+static int __init lfsm_bench_init(void)
+{
+    struct lfsm_instance *inst;
+    int ret = 0;
+
+    if (read_pct + cancel_pct > 100 || !max_samples)
+        return -EINVAL;
+
+    lfsm_bench_nthreads = threads ? threads : num_online_cpus();
+    inst = lfsm_instance_create("lfsm_bench", &lfsm_bench_ops, NULL);
+    if (IS_ERR(inst))
+        return PTR_ERR(inst);
+
+    mutex_lock(&lfsm_bench_lock);
+    lfsm_bench_inst = inst;
+    if (run)
+        ret = lfsm_bench_run_start();
+    if (ret)
+        lfsm_bench_inst = NULL;
+    mutex_unlock(&lfsm_bench_lock);
+
+    if (ret) {
+        lfsm_instance_destroy(inst);
+        cancel_delayed_work_sync(&lfsm_bench_done_work);
+    }
+    return ret;
+}
+
+static void __exit lfsm_bench_exit(void)
+{
+    struct lfsm_instance *inst;
+
+    mutex_lock(&lfsm_bench_lock);
+    lfsm_bench_run_stop();
+    inst = lfsm_bench_inst;
+    lfsm_bench_inst = NULL;
+    mutex_unlock(&lfsm_bench_lock);
+    /* No run can start from here on, so none can schedule it again */
+    cancel_delayed_work_sync(&lfsm_bench_stop_work);
+
+    lfsm_instance_destroy(inst);
+    cancel_delayed_work_sync(&lfsm_bench_done_work);
+}
+
+module_init(lfsm_bench_init);
+module_exit(lfsm_bench_exit);
+
+MODULE_AUTHOR("Christopher Denny <christopherscottdenny@gmail.com>");
+MODULE_DESCRIPTION("LFSM stress and latency benchmark");
+MODULE_LICENSE("GPL");
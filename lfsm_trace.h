@@ -0,0 +1,139 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lfsm
+
+#if !defined(_LFSM_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LFSM_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include "lfsm.h"
+
+/*
+ * Every event identifies the instance by id and name. States and actions
+ * are recorded both as numbers, for filters, and by the names the
+ * instance's own table gives them, since instances created from a table
+ * have states and triggers beyond the four link states.
+ */
+DECLARE_EVENT_CLASS(lfsm_queue_class,
+    TP_PROTO(u32 id, const char *name, int action, const char *action_name,
+             unsigned int qlen),
+    TP_ARGS(id, name, action, action_name, qlen),
+
+    TP_STRUCT__entry(
+        __field(u32, id)
+        __array(char, name, LFSM_NAME_LEN)
+        __field(int, action)
+        __string(action_name, action_name)
+        __field(unsigned int, qlen)
+    ),
+
+    TP_fast_assign(
+        __entry->id = id;
+        strscpy(__entry->name, name, LFSM_NAME_LEN);
+        __entry->action = action;
+        __assign_str(action_name);
+        __entry->qlen = qlen;
+    ),
+
+    TP_printk("id=%u name=%s action=%s qlen=%u",
+              __entry->id, __entry->name, __get_str(action_name), __entry->qlen)
+);
+
+/* qlen is the queue length after the action was added */
+DEFINE_EVENT(lfsm_queue_class, lfsm_enqueue,
+    TP_PROTO(u32 id, const char *name, int action, const char *action_name,
+             unsigned int qlen),
+    TP_ARGS(id, name, action, action_name, qlen)
+);
+
+/* qlen is the queue length after the action was taken off */
+DEFINE_EVENT(lfsm_queue_class, lfsm_dequeue,
+    TP_PROTO(u32 id, const char *name, int action, const char *action_name,
+             unsigned int qlen),
+    TP_ARGS(id, name, action, action_name, qlen)
+);
+
+TRACE_EVENT(lfsm_state_change,
+    TP_PROTO(u32 id, const char *name, int old_state, const char *old_name,
+             int new_state, const char *new_name, u64 gen),
+    TP_ARGS(id, name, old_state, old_name, new_state, new_name, gen),
+
+    TP_STRUCT__entry(
+        __field(u32, id)
+        __array(char, name, LFSM_NAME_LEN)
+        __field(int, old_state)
+        __string(old_name, old_name)
+        __field(int, new_state)
+        __string(new_name, new_name)
+        __field(u64, gen)
+    ),
+
+    TP_fast_assign(
+        __entry->id = id;
+        strscpy(__entry->name, name, LFSM_NAME_LEN);
+        __entry->old_state = old_state;
+        __assign_str(old_name);
+        __entry->new_state = new_state;
+        __assign_str(new_name);
+        __entry->gen = gen;
+    ),
+
+    TP_printk("id=%u name=%s %s -> %s gen=%llu",
+              __entry->id, __entry->name, __get_str(old_name), __get_str(new_name),
+              __entry->gen)
+);
+
+DECLARE_EVENT_CLASS(lfsm_state_class,
+    TP_PROTO(u32 id, const char *name, int state, const char *state_name),
+    TP_ARGS(id, name, state, state_name),
+
+    TP_STRUCT__entry(
+        __field(u32, id)
+        __array(char, name, LFSM_NAME_LEN)
+        __field(int, state)
+        __string(state_name, state_name)
+    ),
+
+    TP_fast_assign(
+        __entry->id = id;
+        strscpy(__entry->name, name, LFSM_NAME_LEN);
+        __entry->state = state;
+        __assign_str(state_name);
+    ),
+
+    TP_printk("id=%u name=%s state=%s",
+              __entry->id, __entry->name, __get_str(state_name))
+);
+
+/* state is the transitional state that timed out */
+DEFINE_EVENT(lfsm_state_class, lfsm_timeout,
+    TP_PROTO(u32 id, const char *name, int state, const char *state_name),
+    TP_ARGS(id, name, state, state_name)
+);
+
+/* state is the state the instance was forced out of */
+DEFINE_EVENT(lfsm_state_class, lfsm_force_down,
+    TP_PROTO(u32 id, const char *name, int state, const char *state_name),
+    TP_ARGS(id, name, state, state_name)
+);
+
+/* state is the new state being announced to subscribers */
+DEFINE_EVENT(lfsm_state_class, lfsm_notify_start,
+    TP_PROTO(u32 id, const char *name, int state, const char *state_name),
+    TP_ARGS(id, name, state, state_name)
+);
+
+DEFINE_EVENT(lfsm_state_class, lfsm_notify_end,
+    TP_PROTO(u32 id, const char *name, int state, const char *state_name),
+    TP_ARGS(id, name, state, state_name)
+);
+
+#endif /* _LFSM_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE lfsm_trace
+#include <trace/define_trace.h>
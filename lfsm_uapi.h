@@ -0,0 +1,142 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * Binary layouts LFSM shares with user space: the /dev/lfsm_state page,
+ * /dev/lfsm_events records and the debugfs dump. Only fixed-width __u*
+ * types are used and no struct has implicit padding, so 32- and 64-bit
+ * readers see the same layout; lfsm.c checks every size and offset with
+ * BUILD_BUG_ON(). State, cause and trigger values are those of enum
+ * link_state (or the instance's own table), enum lfsm_cause and enum
+ * lfsm_trigger in lfsm.h.
+ */
+#ifndef _LFSM_UAPI_H
+#define _LFSM_UAPI_H
+
+#include <linux/types.h>
+
+#define LFSM_NAME_LEN 32
+
+/*
+ * Shared state page, mapped read-only from /dev/lfsm_state. A struct
+ * lfsm_shm_header is followed by LFSM_SHM_SLOTS slots; instance id N, if
+ * below LFSM_SHM_SLOTS, lives in slot N. A slot is consistent when @seq is
+ * even and unchanged across the read:
+ *
+ *     do {
+ *         seq = READ_ONCE(slot->seq);
+ *         rmb();
+ *         state = slot->state; gen = slot->gen; ts = slot->timestamp_ns;
+ *         rmb();
+ *     } while ((seq & 1) || seq != READ_ONCE(slot->seq));
+ */
+#define LFSM_SHM_MAGIC 0x4c46534dU /* "LFSM" */
+#define LFSM_SHM_VERSION 1
+#define LFSM_SHM_SLOTS 1024
+
+#define LFSM_SLOT_VALID (1U << 0)  /* slot holds a live instance */
+
+struct lfsm_shm_header {
+    __u32 magic;
+    __u32 version;
+    __u32 slot_size;
+    __u32 n_slots;
+    __u8 reserved[48];
+};
+
+struct lfsm_state_slot {
+    __u32 seq;            /* odd while the slot is being written */
+    __u32 flags;
+    __u32 id;
+    __u32 state;
+    __u64 gen;            /* as lfsm_instance_get_link_state_gen() */
+    __u64 timestamp_ns;   /* CLOCK_MONOTONIC of the last state change */
+    char name[LFSM_NAME_LEN];
+};
+
+/**
+ * struct lfsm_event_record - A struct lfsm_event as read() from /dev/lfsm_events.
+ * @seq: As struct lfsm_event.
+ * @timestamp_ns: As struct lfsm_event.
+ * @lost: With LFSM_EVREC_OVERRUN, number of records dropped before this one.
+ * @id: Instance id, see /sys/kernel/lfsm/<name>/id.
+ * @old_state: As struct lfsm_event.
+ * @new_state: As struct lfsm_event.
+ * @cause: enum lfsm_cause.
+ * @flags: LFSM_EVREC_*.
+ */
+#define LFSM_EVREC_OVERRUN (1U << 0)  /* the reader's ring overflowed; only @lost is set */
+
+struct lfsm_event_record {
+    __u64 seq;
+    __u64 timestamp_ns;
+    __u64 lost;
+    __u32 id;
+    __u32 old_state;
+    __u32 new_state;
+    __u16 cause;
+    __u16 flags;
+};
+
+/*
+ * Binary snapshot read from debugfs lfsm/dump: a struct lfsm_dump_header,
+ * then for each instance a struct lfsm_dump_instance followed by its
+ * @queue_len pending actions and @history_len past transitions, both oldest
+ * first. Fields are native-endian; readers step over each record by the
+ * sizes in the header, so later versions may append fields.
+ */
+#define LFSM_DUMP_MAGIC 0x44534d46U /* "FMSD" */
+#define LFSM_DUMP_VERSION 1
+#define LFSM_HISTORY_LEN 64 /* transitions kept per instance */
+
+struct lfsm_dump_header {
+    __u32 magic;
+    __u32 version;
+    __u32 n_instances;
+    __u16 header_size;
+    __u16 instance_size;
+    __u16 action_size;
+    __u16 history_size;
+    __u32 reserved;
+    __u64 timestamp_ns;   /* CLOCK_MONOTONIC of the snapshot */
+} __attribute__((packed));
+
+struct lfsm_dump_instance {
+    __u32 id;
+    __u32 state;
+    __u64 gen;
+    __u32 queue_len;
+    __u32 history_len;
+    __u64 history_total;  /* transitions recorded since creation */
+    char name[LFSM_NAME_LEN];
+} __attribute__((packed));
+
+#define LFSM_DUMP_ACT_WAITED (1U << 0)  /* a request handle waits on the action */
+#define LFSM_DUMP_ACT_URGENT (1U << 1)  /* queued on the priority lane */
+
+struct lfsm_dump_action {
+    __u64 enqueue_ns;
+    __u32 type;           /* enum lfsm_trigger */
+    __u32 flags;
+} __attribute__((packed));
+
+/**
+ * struct lfsm_history_record - One settled transition of an instance.
+ * @seq: As struct lfsm_event.
+ * @timestamp_ns: As struct lfsm_event.
+ * @duration_ns: Time from dispatching the transition to settling it, 0 for
+ *               a force_down from a stable state.
+ * @old_state: As struct lfsm_event.
+ * @new_state: As struct lfsm_event.
+ * @cause: enum lfsm_cause.
+ * @reserved: Zero.
+ */
+struct lfsm_history_record {
+    __u64 seq;
+    __u64 timestamp_ns;
+    __u64 duration_ns;
+    __u32 old_state;
+    __u32 new_state;
+    __u32 cause;
+    __u32 reserved;
+} __attribute__((packed));
+
+#endif /* _LFSM_UAPI_H */